@@ -58,19 +58,28 @@ static void annot_map_args(node_t *map, ebpf_t *e) {
 }
 
 int annot_map_method(node_t* expr, ebpf_t* ctx) {
-	int err = 0;
-	node_t* left, *right;
+	node_t* left, *right, *arg;
+	int agg;
 
 	left = expr->expr.left;
 	right = expr->expr.right;
 
 	annot_map_args(left, ctx);
 
+	_foreach(arg, right->call.args)
+		sema(arg, ctx);
+
 	right->parent = left;
-	map_dec(ctx->st, left, NULL);
-	expr->annot.type = TYPE_MAP_METHOD;
 
-	return err;
+	/* the method may widen the key or value before the map is made */
+	agg = global_method_annot(expr);
+	if (agg < 0)
+		verror("unknown map method: %s", right->name);
+
+	map_agg_dec(ctx->st, left, right, agg);
+
+	expr->annot.type = TYPE_MAP_METHOD;
+	return 0;
 }
 
 static int annot_dec(node_t *n, ebpf_t *e) {
@@ -113,7 +122,8 @@ void annot_probe_args(node_t* expr, ebpf_t* ctx) {
 	field.name = ctx->name;
 	field.field = data->name;
 
-	bpf_read_field(&field);
+	if (bpf_read_field(&field))
+		verror("%s has no field %s", field.name, field.field);
 
 	data->annot.type = field.type;
 	data->annot.offs = field.offs;
@@ -151,31 +161,107 @@ void annot_cast(node_t* expr, ebpf_t* ctx) {
 	expr->annot.offs = num - '0';
 }
 
-void annot_struct_filed(node_t* expr, ebpf_t* ctx) {
-	sym_t* sym;
+typedef struct chain {
+	char path[128];
+	int read;
 	int offs;
-	char* sname, *filed;
+	struct_field_t f;
+} chain_t;
+
+/* resolves var->a.b->c from the cast variable outwards, every pointer
+ * followed starts a read of its own, named by the path up to it. */
+static void annot_chain(node_t* expr, ebpf_t* ctx, chain_t* c) {
+	char sname[sizeof(c->f.type)];
+	node_t* field;
+	sym_t* sym;
+	int ptr;
+
+	if (expr->type == NODE_VAR) {
+		sym = symtable_get(ctx->st, expr->name);
+		if (!sym || !sym->cast)
+			verror("%s is not a struct pointer", expr->name);
+
+		snprintf(c->path, sizeof(c->path), "%s", expr->name);
+		snprintf(c->f.type, sizeof(c->f.type), "*%s", sym->cast);
+		c->read = -1;
+		c->offs = sym->vannot.offs;
+		return;
+	}
+
+	if (expr->type != NODE_EXPR || expr->expr.right->type != NODE_VAR)
+		verror("can't take a field of this expression");
+
+	annot_chain(expr->expr.left, ctx, c);
 
-	sym = symtable_get(ctx->st, expr->expr.left->name);
-	sname = sym->cast;
-	filed = expr->expr.right->name;
+	field = expr->expr.right;
+	ptr = expr->expr.opcode == OP_ACCESS;
 
-	offs = btf_get_field_off(sname, filed);
+	if (ptr) {
+		if (c->f.type[0] != '*')
+			verror("%s is not a struct pointer", c->path);
 
-	expr->annot.offs = offs;
+		/* the pointer is a field of the read before, or an argument */
+		if (c->read >= 0)
+			c->read = ebpf_read_span(ctx, c->read, c->offs, sizeof(void*));
+
+		c->read = ebpf_read_new(ctx, vstr(c->path), c->read,
+			c->read < 0 ? c->offs : 0, c->offs);
+		c->offs = 0;
+		snprintf(sname, sizeof(sname), "%s", c->f.type + 1);
+	} else {
+		if (!c->f.type[0] || c->f.type[0] == '*' || c->f.type[0] == '[')
+			verror("%s is not a struct", c->path);
+
+		snprintf(sname, sizeof(sname), "%s", c->f.type);
+	}
+
+	if (btf_get_member(sname, field->name, &c->f))
+		verror("%s has no field %s", sname, field->name);
+
+	c->offs += c->f.offs;
+	snprintf(c->path + strlen(c->path), sizeof(c->path) - strlen(c->path),
+		"%s%s", ptr ? "->" : ".", field->name);
+}
+
+/* the field is loaded at its own width and extended to 64 bits */
+void annot_struct_filed(node_t* expr, ebpf_t* ctx) {
+	chain_t c;
+
+	annot_chain(expr, ctx, &c);
+
+	if (c.f.type[0] && c.f.type[0] != '*')
+		verror("%s is not a scalar", c.path);
+
+	if (c.f.size != 1 && c.f.size != 2 && c.f.size != 4 && c.f.size != 8)
+		verror("%s is %d bytes wide", c.path, c.f.size);
+
+	expr->annot.read = ebpf_read_span(ctx, c.read, c.offs, c.f.size);
+	expr->annot.sign = c.f.sign;
+	expr->annot.offs = c.offs;
 	expr->annot.size = 8;
 	expr->annot.type = TYPE_INT;
+	expr->expr.right->annot.size = c.f.size;
+}
+
+/* a chain of accesses is rooted in a variable */
+static node_t* access_root(node_t* expr) {
+	while (expr->type == NODE_EXPR
+	       && (expr->expr.opcode == OP_ACCESS || expr->expr.opcode == OP_DOT))
+		expr = expr->expr.left;
+
+	return expr;
 }
 
 void annot_accses(node_t* expr, ebpf_t* ctx) {
-	sym_t* sym;
-	
-	sym = symtable_get(ctx->st, expr->expr.left->name);
-	if (!sym) {
+	node_t* root = access_root(expr);
+
+	/* args->field of a tracepoint */
+	if (expr->expr.left == root && expr->expr.opcode == OP_ACCESS
+	    && root->type == NODE_VAR && !symtable_get(ctx->st, root->name)) {
 		annot_probe_args(expr, ctx);
 		return;
 	}
-	
+
 	annot_struct_filed(expr, ctx);
 }
 
@@ -192,6 +278,7 @@ void annot_expr(node_t* expr, ebpf_t* ctx) {
 		annot_map_method(expr, ctx);
 		break;
 	case OP_ACCESS:
+	case OP_DOT:
 		annot_accses(expr, ctx);
 		break;
 	default:
@@ -203,17 +290,27 @@ void annot_expr(node_t* expr, ebpf_t* ctx) {
 	}
 }
 
+static inline int is_struct_field(node_t* n) {
+	return n->type == NODE_EXPR
+		&& (n->expr.opcode == OP_ACCESS || n->expr.opcode == OP_DOT)
+		&& n->expr.right->annot.size;
+}
+
 void annot_rec(node_t *n, ebpf_t *code) {
 	node_t *arg;
 	ssize_t size = 0;
 
 	_foreach(arg, n->rec.args) {
 		get_annot(arg, code);
-		
-		size += arg->annot.size;
+
+		/* struct fields go out at their own width */
+		if (is_struct_field(arg))
+			arg->annot.size = arg->expr.right->annot.size;
+
+		size = _REC_ALIGN(size, arg->annot.size) + arg->annot.size;
 	}
 
-	n->annot.size = size;
+	n->annot.size = _ALIGNED(size);
 	n->annot.type = TYPE_REC;
 }
 
@@ -329,10 +426,13 @@ void assign_rec(node_t *node, ebpf_t *code) {
 	size_t offs;
 	assign_stack(node, code);
 
-	offs = node->annot.addr;
+	evhandler_set_size(node->rec.args->integer, node->annot.size);
+
+	offs = 0;
 
 	_foreach(head, node->rec.args) {
-		head->annot.addr = offs;
+		offs = _REC_ALIGN(offs, head->annot.size);
+		head->annot.addr = node->annot.addr + offs;
 		offs += head->annot.size;
 	}
 }
@@ -346,6 +446,9 @@ void assign_method(node_t* expr, ebpf_t* code) {
 	args = map->map.args;
 	sym = symtable_get(code->st, map->name);
 
+	/* methods that extend the key, like hist's bucket, get their part
+	 * right after the user's key so the two form one map key */
+	code->sp -= map->annot.ksize - args->annot.size;
 	addr = ebpf_addr_get(args, code);
 
 	args->annot.addr = addr;
@@ -395,6 +498,61 @@ void loc_assign(node_t* node, ebpf_t* code) {
 	}
 }
 
+static int do_list(node_t *head, ebpf_t *ctx);
+
+/* predicates run ahead of the probe's data, so every operand has to
+ * be an integer computed in registers. a map is only looked up, with
+ * integer keys, and has to be assigned somewhere by then. */
+static void pred_check(node_t* n, ebpf_t* ctx) {
+	node_t* arg;
+
+	switch (n->type) {
+	case NODE_INT:
+		return;
+	case NODE_EXPR:
+		if (n->expr.opcode == OP_ACCESS || n->expr.opcode == OP_DOT)
+			break;
+
+		pred_check(n->expr.left, ctx);
+		pred_check(n->expr.right, ctx);
+		return;
+	case NODE_CALL:
+		break;
+	case NODE_MAP:
+		if (!symtable_get(ctx->st, n->name))
+			verror("map '%s' in the predicate is never assigned", n->name);
+
+		_foreach(arg, n->map.args) {
+			if (arg->annot.type != TYPE_INT)
+				verror("map '%s' in the predicate needs integer keys", n->name);
+			pred_check(arg, ctx);
+		}
+		break;
+	default:
+		verror("predicate can only use integers, maps and calls");
+	}
+
+	if (n->annot.type != TYPE_INT)
+		verror("predicate can only compare integers");
+}
+
+/* annotated after the body, so that maps the body assigns exist */
+static void annot_pred(node_t* pred, ebpf_t* ctx) {
+	sema(pred, ctx);
+
+	switch (pred->type) {
+	case NODE_INT:
+	case NODE_EXPR:
+	case NODE_CALL:
+	case NODE_MAP:
+		break;
+	default:
+		verror("predicate is not an expression");
+	}
+
+	pred_check(pred, ctx);
+}
+
 static int do_list(node_t *head, ebpf_t *ctx) {
 	node_t *elem, *next = head;
 
@@ -415,6 +573,9 @@ void sema(node_t *node, ebpf_t *ctx) {
 	case NODE_KPROBE:
 	case NODE_PROBE:
 		do_list(node->probe.stmts, ctx);
+		if (node->probe.pred)
+			annot_pred(node->probe.pred, ctx);
+		ebpf_read_assign(ctx);
 		break;
 	case NODE_TEST:
 		do_list(node->probe.stmts, ctx);
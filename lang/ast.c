@@ -5,7 +5,7 @@
 #include "ast.h"
 
 node_t *node_new(node_type t) {
-    node_t *n = vmalloc(sizeof(*n));
+    node_t *n = vcalloc(1, sizeof(*n));
 
     n->type = t;
     return n;
@@ -30,6 +30,16 @@ node_t *node_int_new(size_t integer) {
     return n;
 }
 
+node_t *node_call_new(char *name, node_t *args) {
+    node_t *n = node_new(NODE_CALL);
+
+    n->name = name;
+    n->call.args = args;
+    n->next = NULL;
+
+    return n;
+}
+
 node_t *node_expr_new(int opcode, node_t *left, node_t *right) {
     node_t *n = node_new(NODE_EXPR);
 
@@ -95,6 +105,7 @@ node_t *node_probe_new(char *name, node_t *stmts) {
     node_t *n = node_new(NODE_PROBE);
 
     n->probe.name = name;
+    n->probe.pred = NULL;
     n->probe.stmts = stmts;
 
     return n;
@@ -104,6 +115,7 @@ node_t *node_kprobe_new(char *name, node_t *stmts) {
     node_t *n = node_new(NODE_KPROBE);
 
     n->probe.name = name;
+    n->probe.pred = NULL;
     n->probe.stmts = stmts;
 
     return n;
@@ -113,11 +125,21 @@ node_t* node_test_new(char* name, node_t* stmts) {
     node_t* n = node_new(NODE_TEST);
 
     n->probe.name = name;
+    n->probe.pred = NULL;
     n->probe.stmts = stmts;
 
     return n;
 }
 
+node_t* node_interval_new(size_t ms, node_t* stmts) {
+    node_t* n = node_new(NODE_INTERVAL);
+
+    n->interval.ms = ms;
+    n->interval.stmts = stmts;
+
+    return n;
+}
+
 static int do_list(node_t *head) {
 	node_t *elem, *next = head;
 
@@ -150,6 +172,9 @@ void free_node(node_t *node) {
     case NODE_REC:
         do_list(node->rec.args);
         break;
+    case NODE_INTERVAL:
+        do_list(node->interval.stmts);
+        break;
     case NODE_STR:
         free(node->name);
         break;
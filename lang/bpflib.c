@@ -1,10 +1,13 @@
 #include <assert.h>
+#include <string.h>
+#include <sys/param.h>
 
 #include "bpflib.h"
 
 ebpf_t *ebpf_new() {
 	ebpf_t *code = vcalloc(1, sizeof(*code));
 	code->ip = code->prog;
+	code->probe = -1;
 	return code;
 }
 
@@ -98,7 +101,7 @@ void ebpf_emit_map_look(ebpf_t *code, int fd, ssize_t kaddr) {
 	ebpf_emit(code, CALL(BPF_FUNC_map_lookup_elem));
 }
 
-void ebpf_emit_map_update(ebpf_t *code, int fd, ssize_t kaddr, ssize_t vaddr) {
+void ebpf_emit_map_update(ebpf_t *code, int fd, ssize_t kaddr, ssize_t vaddr, int flags) {
 	ebpf_emit_mapld(code, BPF_REG_1, fd);
 
 	ebpf_emit(code, MOV(BPF_REG_2, BPF_REG_10));
@@ -107,23 +110,52 @@ void ebpf_emit_map_update(ebpf_t *code, int fd, ssize_t kaddr, ssize_t vaddr) {
 	ebpf_emit(code, MOV(BPF_REG_3, BPF_REG_10));
 	ebpf_emit(code, ALU_IMM(OP_ADD, BPF_REG_3, vaddr));
 
-	ebpf_emit(code, MOV_IMM(BPF_REG_4, 0));
+	ebpf_emit(code, MOV_IMM(BPF_REG_4, flags));
 	ebpf_emit(code, CALL(BPF_FUNC_map_update_elem));
 }
 
+/* a hit is a single atomic add on the value in place. a miss inserts
+ * the first count, and if another cpu inserted the key first the add
+ * is done on its entry instead. */
+void ebpf_emit_map_inc(ebpf_t *code, int fd, ssize_t kaddr, ssize_t vaddr) {
+	struct bpf_insn *miss, *done, *raced;
+
+	ebpf_emit_map_look(code, fd, kaddr);
+	miss = code->ip;
+	ebpf_emit(code, JMP_IMM(BPF_JA, 0, 0, 0));
+	ebpf_emit(code, MOV_IMM(BPF_REG_1, 1));
+	ebpf_emit(code, XADDDW(BPF_REG_0, 0, BPF_REG_1));
+	done = code->ip;
+	ebpf_emit(code, JMP_IMM(BPF_JA, 0, 0, 0));
+
+	ebpf_emit_at(miss, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, code->ip - miss - 1));
+	ebpf_emit(code, MOV_IMM(BPF_REG_1, 1));
+	ebpf_emit(code, STXDW(BPF_REG_10, vaddr, BPF_REG_1));
+	ebpf_emit_map_update(code, fd, kaddr, vaddr, BPF_NOEXIST);
+	raced = code->ip;
+	ebpf_emit(code, JMP_IMM(BPF_JA, 0, 0, 0));
+
+	ebpf_emit_map_look(code, fd, kaddr);
+	ebpf_emit(code, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 2));
+	ebpf_emit(code, MOV_IMM(BPF_REG_1, 1));
+	ebpf_emit(code, XADDDW(BPF_REG_0, 0, BPF_REG_1));
+
+	ebpf_emit_at(raced, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, code->ip - raced - 1));
+	ebpf_emit_at(done, JMP_IMM(BPF_JA, 0, 0, code->ip - done - 1));
+}
+
 void ebpf_emit_count(ebpf_t *code, ssize_t addr) {
 	ebpf_emit(code, LDXB(BPF_REG_0, addr, BPF_REG_10));
 	ebpf_emit(code, ALU_IMM(BPF_ADD, BPF_REG_0, 1));
 	ebpf_emit(code, STXDW(BPF_REG_10, addr, BPF_REG_0));
 }
 
-void ebpf_emit_bool(ebpf_t *code, int op, int r0, int r2) {
-	int gregs[3] = {BPF_REG_6, BPF_REG_7, BPF_REG_8};
-
-	ebpf_emit(code, JMP(op, gregs[r0], gregs[r2], 2));
-	ebpf_emit(code, MOV_IMM(gregs[r0], 0));
+/* dst = a op b, dst may be either operand */
+void ebpf_emit_bool(ebpf_t *code, int op, int dst, int a, int b) {
+	ebpf_emit(code, JMP(op, a, b, 2));
+	ebpf_emit(code, MOV_IMM(dst, 0));
 	ebpf_emit(code, JMP_IMM(BPF_JA, 0, 0, 1));
-	ebpf_emit(code, MOV_IMM(gregs[r0], 1));
+	ebpf_emit(code, MOV_IMM(dst, 1));
 }
 
 void ebpf_emit_read(ebpf_t *code, ssize_t to, int from, size_t size) {
@@ -140,4 +172,90 @@ void ebpf_emit_read_str(ebpf_t *code, ssize_t to, int from, size_t size) {
 	ebpf_emit(code, MOV_IMM(BPF_REG_2, size));
 	ebpf_emit(code, MOV(BPF_REG_3, from));
 	ebpf_emit(code, CALL(BPF_FUNC_probe_read_str));
-}
\ No newline at end of file
+}
+
+ebpf_read_t* ebpf_read_get(ebpf_t* code, const char* name) {
+	int i;
+
+	for (i = 0; i < code->nreads; i++) {
+		if (!strcmp(code->reads[i].name, name))
+			return &code->reads[i];
+	}
+
+	return NULL;
+}
+
+/* reads are named by the pointer expression they go through, so all
+ * fields reached through the same pointer share one */
+int ebpf_read_new(ebpf_t* code, const char* name, int parent, int arg, ssize_t poffs) {
+	ebpf_read_t* rd;
+
+	rd = ebpf_read_get(code, name);
+	if (rd)
+		return rd - code->reads;
+
+	if (code->nreads == EBPF_MAX_READS)
+		verror("fields are read through more than %d pointers", EBPF_MAX_READS);
+
+	rd = &code->reads[code->nreads];
+	rd->name = name;
+	rd->parent = parent;
+	rd->arg = arg;
+	rd->poffs = poffs;
+	rd->lo = rd->hi = -1;
+	return code->nreads++;
+}
+
+static int ebpf_read_fits(ebpf_read_t* rd, ssize_t offs, size_t size) {
+	if (rd->hi < 0)
+		return 1;
+
+	return MAX(rd->hi, offs + (ssize_t)size) - MIN(rd->lo, offs) <= EBPF_READ_SPAN;
+}
+
+/* widen a read to cover one more field. fields too far apart to share
+ * a copy of reasonable size go to another read through the same
+ * pointer, the one used is returned */
+int ebpf_read_span(ebpf_t* code, int read, ssize_t offs, size_t size) {
+	ebpf_read_t* rd = &code->reads[read];
+	int i;
+
+	/* starting on a word keeps the copy's fields as aligned as the struct's */
+	size += offs % 8;
+	offs -= offs % 8;
+
+	for (i = read; i < code->nreads; i++) {
+		if (code->reads[i].name == rd->name && ebpf_read_fits(&code->reads[i], offs, size))
+			break;
+	}
+
+	if (i == code->nreads) {
+		if (code->nreads == EBPF_MAX_READS)
+			verror("fields are read through more than %d pointers", EBPF_MAX_READS);
+
+		code->reads[i] = *rd;
+		code->reads[i].lo = code->reads[i].hi = -1;
+		code->nreads++;
+	}
+
+	rd = &code->reads[i];
+	if (rd->hi < 0) {
+		rd->lo = offs;
+		rd->hi = offs + size;
+		return i;
+	}
+
+	rd->lo = MIN(rd->lo, offs);
+	rd->hi = MAX(rd->hi, (ssize_t)(offs + size));
+	return i;
+}
+
+/* the spans are only known once the whole probe is annotated */
+void ebpf_read_assign(ebpf_t* code) {
+	int i;
+
+	for (i = 0; i < code->nreads; i++) {
+		code->sp -= _ALIGNED(code->reads[i].hi - code->reads[i].lo);
+		code->reads[i].addr = code->sp;
+	}
+}
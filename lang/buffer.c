@@ -1,6 +1,14 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
-#include <poll.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -16,25 +24,34 @@
 
 static uint64_t next_type = 0;
 
-TAILQ_HEAD(evhandlers, evhandler);
-static struct evhandlers evh_list = TAILQ_HEAD_INITIALIZER(evh_list);
+/* types are handed out densely, so the type is the index. */
+static evhandler_t** evh_table;
+static size_t evh_cap;
 
 void evhandler_register(evhandler_t* evh) {
+	if (next_type == evh_cap) {
+		evh_cap = evh_cap ? evh_cap * 2 : 16;
+		evh_table = vrealloc(evh_table, evh_cap * sizeof(*evh_table));
+	}
+
 	evh->type = next_type++;
-	TAILQ_INSERT_TAIL(&evh_list, evh, node);
+	evh_table[evh->type] = evh;
 }
 
-static evhandler_t* evhandler_find(uint64_t type) {
-	evhandler_t* evh;
+static inline evhandler_t* evhandler_find(uint64_t type) {
+	return type < next_type ? evh_table[type] : NULL;
+}
 
-	TAILQ_FOREACH(evh, &evh_list, node) {
-		if (evh->type == type)
-			return evh;
-	}
+void evhandler_set_size(uint64_t type, size_t size) {
+	evhandler_t* evh = evhandler_find(type);
 
-	return NULL;
+	if (evh)
+		evh->size = size;
 }
 
+static evfile_t* evfile;
+static void evfile_append(evfile_t* f, event_t* ev, size_t size);
+
 static struct ret_value event_handle(event_t* ev, size_t size) {
 	evhandler_t* evh;
 	
@@ -42,23 +59,94 @@ static struct ret_value event_handle(event_t* ev, size_t size) {
 	evh = evhandler_find(ev->type);
 	if (!evh) {
 		verror("unknown event: type:%#"PRIx64" size:%#zx\n", 
-				ev->size, size);	
+				ev->type, size);	
 		return (struct ret_value) { .err = 1, .val = ENOSYS};
 	}
 
+	/* transports may pad the record, but never shorten it */
+	if (size < evh->size) {
+		_e("short event: type:%#"PRIx64" size:%#zx expected:%#zx",
+			ev->type, size, evh->size);
+		return (struct ret_value) { .err = 1, .val = EINVAL};
+	}
+
+	if (evfile) {
+		evfile_append(evfile, ev, size);
+		return (struct ret_value) {};
+	}
+
 	evh->handle(ev, evh->priv);
 	return (struct ret_value) {};
 }
 
-void evqueue_init(evpipe_t* evp, uint32_t cpu, size_t size) {
+/* perf wants a power of two number of data pages */
+static size_t evqueue_size(size_t size) {
+	size_t page = sysconf(_SC_PAGESIZE), n;
+
+	for (n = page; n < size; n <<= 1);
+	return n;
+}
+
+static int evpipe_watch(int epfd, int fd, void* data) {
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = data,
+	};
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		verror("could not watch queue");
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void evbuf_push(evbuf_t* b, const void* data, size_t size) {
+	if (b->len + size > b->cap) {
+		b->cap = b->cap ? b->cap * 2 : (64 << 10);
+		if (b->cap < b->len + size)
+			b->cap = b->len + size;
+		b->data = vrealloc(b->data, b->cap);
+	}
+
+	memcpy(b->data + b->len, data, size);
+	b->len += size;
+}
+
+/* reader threads only copy records out of the ring, they are ordered
+ * and handled by the merge stage in evpipe_merge(). records are kept
+ * as a 64-bit size followed by the padded event. */
+static struct ret_value event_deliver(evqueue_t* q, event_t* ev, size_t size) {
+	uint64_t len = size;
+	uint8_t pad[8] = {};
+
+	if (!q->rd)
+		return event_handle(ev, size);
+
+	evbuf_push(&q->rd->local, &len, sizeof(len));
+	evbuf_push(&q->rd->local, ev, size);
+	evbuf_push(&q->rd->local, pad, _ALIGNED(size) - size);
+	return (struct ret_value) {};
+}
+
+int evqueue_init(evpipe_t* evp, uint32_t cpu, size_t size) {
 	struct perf_event_attr attr = {0};
 	evqueue_t* q = &evp->q[cpu];	
+	size_t page = sysconf(_SC_PAGESIZE);
 	int err;
 
+	size = evqueue_size(size);
+
 	attr.type = PERF_TYPE_SOFTWARE;
 	attr.config = PERF_COUNT_SW_BPF_OUTPUT;
 	attr.sample_type = PERF_SAMPLE_RAW;
-	attr.wakeup_events = 1;
+
+	if (evp->watermark) {
+		attr.watermark = 1;
+		attr.wakeup_watermark = evp->watermark < size ? evp->watermark : size / 2;
+	} else {
+		attr.wakeup_events = 1;
+	}
 
 	q->fd = perf_event_open(&attr, -1, cpu, -1, 0);
 	if (q->fd < 0) {
@@ -73,26 +161,79 @@ void evqueue_init(evpipe_t* evp, uint32_t cpu, size_t size) {
 	}
 	
 
-	size += sysconf(_SC_PAGESIZE);
-	q->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0);
+	q->mem = mmap(NULL, size + page, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0);
 	if (q->mem == MAP_FAILED) {
 		verror("clould not mmap queue");
 		return -1;
 	}
+	q->size = size;
 
-	evp->poll[cpu].fd = q->fd;
-	evp->poll[cpu].events = POLLIN;
-
-	return 0;
+	return evpipe_watch(evp->epfd, q->fd, q);
 }
 
 
+static int evring_init(evpipe_t* evp, size_t size) {
+	evring_t* r = &evp->ring;
+	size_t page = sysconf(_SC_PAGESIZE);
+	void* mem;
+
+	r->size = evqueue_size(size);
+
+	evp->mapfd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, 0, 0, r->size, 0);
+	if (evp->mapfd < 0)
+		return evp->mapfd;
+
+	mem = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, evp->mapfd, 0);
+	if (mem == MAP_FAILED) {
+		verror("could not mmap ring consumer page");
+		return -1;
+	}
+	r->consumer = mem;
+
+	/* the data area is mapped twice back to back, so a record that
+	 * wraps around the end is still contiguous in our address space. */
+	mem = mmap(NULL, page + 2 * r->size, PROT_READ, MAP_SHARED, evp->mapfd, page);
+	if (mem == MAP_FAILED) {
+		verror("could not mmap ring data");
+		return -1;
+	}
+	r->producer = mem;
+	r->data = mem + page;
+
+	return evpipe_watch(evp->epfd, evp->mapfd, r);
+}
+
 int evpipe_init(evpipe_t* evp, size_t qsize) {
 	uint32_t cpu;
 	int err;
 	
 	evp->ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-	evp->mapfd = bpf_map_create(BPF_MAP_TYPE_PERF_EVENT_ARRAY, sizeof(uint32_t), sizeof(int), evp->ncpus);
+	evp->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (evp->epfd < 0) {
+		verror("could not create epoll instance");
+		return -errno;
+	}
+
+	evp->events = vcalloc(evp->ncpus, sizeof(*evp->events));
+
+	evp->lost.fd = bpf_map_create(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t),
+			sizeof(uint64_t), EVPIPE_MAX_PROBES, 0);
+	if (evp->lost.fd < 0)
+		_pr_debug("could not create lost map, drops are not counted\n");
+
+	evp->lost.cpu = vcalloc(cpus_possible(), sizeof(uint64_t));
+	evp->lost.probe = vcalloc(EVPIPE_MAX_PROBES, sizeof(uint64_t));
+
+	if (evp->ringbuf) {
+		err = evring_init(evp, qsize * evp->ncpus);
+		if (!err)
+			return 0;
+
+		_pr_debug("ring buffer not supported (%d), using perf buffers\n", err);
+		evp->ringbuf = 0;
+	}
+
+	evp->mapfd = bpf_map_create(BPF_MAP_TYPE_PERF_EVENT_ARRAY, sizeof(uint32_t), sizeof(int), evp->ncpus, 0);
 	
 	if (evp->mapfd < 0) {
 		verror("clould not create map in evpipe init");
@@ -100,11 +241,14 @@ int evpipe_init(evpipe_t* evp, size_t qsize) {
 	}
 
 	evp->q = vcalloc(evp->ncpus, sizeof(*evp->q)); 
-	evp->poll = vcalloc(evp->ncpus, sizeof(*evp->poll));	
 
 	for (cpu = 0; cpu < evp->ncpus; cpu++) {
-		evqueue_init(evp, cpu, qsize);
+		err = evqueue_init(evp, cpu, qsize);
+		if (err)
+			return err;
 	}
+
+	return 0;
 }
 
 
@@ -122,28 +266,29 @@ static inline void __set_tail(struct perf_event_mmap_page* mem, uint64_t tail) {
 
 
 struct ret_value evqueue_drain(evqueue_t* q) {
-	struct lost_event* lost;
 	struct ret_value ret = {};
 
-	uint16_t size, offs, head, tail;
-	uint8_t* base, *this, *next;
-	event_t* ev;
-	int err = 0;
+	uint64_t size, head, tail, left;
+	uint8_t* base, *this;
+	sample_t* ev;
 
 	size = q->mem->data_size;
-	offs = q->mem->data_offset;
-	base = (uint8_t*)q->mem + offs;
+	base = (uint8_t*)q->mem + q->mem->data_offset;
 
 	for (head = __get_head(q->mem); q->mem->data_tail != head; 
-		__set_tail(q->mem, q->mem->data_tail+ev->hdr.size)) {
+		__set_tail(q->mem, tail + ev->hdr.size)) {
 		tail = q->mem->data_tail;
-		this = base + (tail % size);
+		this = base + (tail & (size - 1));
 		ev = (void*) this;
-		next = base + (tail + ev->hdr.size) % size;
+		left = (base + size) - this;
+
+		/* a wrapped record is stitched together in a scratch buffer
+		 * sized for the largest possible record, so it is never
+		 * reallocated; every other record is decoded in place. */
+		if (ev->hdr.size > left) {
+			if (!q->buf)
+				q->buf = vmalloc(UINT16_MAX);
 
-		if (next < this) {
-			size_t left = (base + size) - this;
-			q->buf = realloc(q->buf, ev->hdr.size);
 			memcpy(q->buf, this, left);
 			memcpy(q->buf + left, base, ev->hdr.size - left);
 			ev = q->buf;
@@ -151,13 +296,11 @@ struct ret_value evqueue_drain(evqueue_t* q) {
 
 		switch(ev->hdr.type) {
 			case PERF_RECORD_SAMPLE:
-				ret = event_handle(ev, ev->hdr.size);
+				ret = event_deliver(q, (event_t*)ev->data, ev->size);
 				break;
 			case PERF_RECORD_LOST:
-				lost = (void*) ev;
-				_e("lost %"PRId64" events\n", lost->lost);
-				ret.err = 1;
-				ret.val = EOVERFLOW;
+				/* the failing perf_event_output() call has
+				 * already counted these, see evpipe_lost_report() */
 				break;
 			default:
 				_e("unknown perf event %#"PRIx32"\n", ev->hdr.type);
@@ -173,12 +316,418 @@ struct ret_value evqueue_drain(evqueue_t* q) {
 	return ret;
 }
 
+struct ret_value evring_drain(evring_t* r) {
+	struct ret_value ret = {};
+	unsigned long cons, prod;
+	uint32_t len, *hdr;
+
+	cons = __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE);
+	prod = __atomic_load_n(r->producer, __ATOMIC_ACQUIRE);
+
+	while (cons < prod) {
+		hdr = (void*)(r->data + (cons & (r->size - 1)));
+		len = __atomic_load_n(hdr, __ATOMIC_ACQUIRE);
+
+		if (len & BPF_RINGBUF_BUSY_BIT)
+			break;
+
+		cons += _ALIGNED((len & ~BPF_RINGBUF_DISCARD_BIT) + BPF_RINGBUF_HDR_SZ);
+
+		if (!(len & BPF_RINGBUF_DISCARD_BIT))
+			ret = event_handle((void*)hdr + BPF_RINGBUF_HDR_SZ, len);
+
+		__atomic_store_n(r->consumer, cons, __ATOMIC_RELEASE);
+
+		if (ret.err || ret.exit)
+			break;
+	}
+
+	return ret;
+}
+
+static struct ret_value evpipe_drain(evpipe_t* evp, void* q) {
+	if (evp->ringbuf)
+		return evring_drain(q);
+
+	return evqueue_drain(q);
+}
+
+static uint64_t clock_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* events below the wakeup watermark do not wake us up, so every queue
+ * is drained once the flush timeout expires to keep latency bounded. */
+static struct ret_value evpipe_flush(evpipe_t* evp) {
+	struct ret_value ret = {};
+	uint32_t cpu;
+
+	if (evp->ringbuf) {
+		ret = evring_drain(&evp->ring);
+	} else {
+		for (cpu = 0; cpu < evp->ncpus; cpu++) {
+			ret = evqueue_drain(&evp->q[cpu]);
+			if (ret.err | ret.exit)
+				break;
+		}
+	}
+
+	obuf_flush();
+	evp->flushed = clock_ns();
+	return ret;
+}
+
+/* ms until the next flush is due, 0 once it is, -1 for never */
+static int evpipe_flush_due(evpipe_t* evp, int timeout) {
+	uint64_t now = clock_ns(), due = evp->flushed + timeout * 1000000ULL;
+
+	if (timeout < 0)
+		return -1;
+
+	if (!evp->flushed)
+		evp->flushed = now;
+
+	if (now >= due)
+		return 0;
+
+	return (due - now + 999999) / 1000000;
+}
+
+#define EVREADER_SLACK_NS 1000000
+
+static void evreader_publish(evreader_t* rd, uint64_t start) {
+	evpipe_t* evp = rd->evp;
+
+	pthread_mutex_lock(&evp->lock);
+	evbuf_push(&rd->pending, rd->local.data, rd->local.len);
+
+	/* a record stamped just before the drain started may still be
+	 * in flight, so only promise ordering up to a little earlier. */
+	rd->horizon = start - EVREADER_SLACK_NS;
+	pthread_cond_signal(&evp->cond);
+	pthread_mutex_unlock(&evp->lock);
+
+	rd->local.len = 0;
+}
+
+static void* evreader_run(void* _rd) {
+	evreader_t* rd = _rd;
+	evpipe_t* evp = rd->evp;
+	struct epoll_event* events;
+	cpu_set_t set;
+	uint64_t start;
+	uint32_t i;
+	int ready;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < rd->ncpus; i++)
+		CPU_SET(rd->cpus[i], &set);
+
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	/* allocated after pinning so the pages are local to our node */
+	events = vcalloc(rd->ncpus, sizeof(*events));
+
+	while (!__atomic_load_n(&evp->stop, __ATOMIC_RELAXED)) {
+		ready = epoll_wait(rd->epfd, events, rd->ncpus, evp->timeout);
+		start = clock_ns();
+
+		if (ready < 0 && errno != EINTR)
+			break;
+
+		/* the horizon covers every queue we own, so queues below
+		 * the watermark are drained too, or they could still hold
+		 * records older than it. */
+		for (i = 0; i < rd->ncpus; i++)
+			evqueue_drain(&evp->q[rd->cpus[i]]);
+
+		evreader_publish(rd, start);
+	}
+
+	free(events);
+	return NULL;
+}
+
+/* group cpus by numa node, so a reader only owns queues that live on
+ * its own node. */
+static void cpus_by_node(uint32_t* order, uint32_t ncpus) {
+	char line[0x400];
+	bool* mask, *placed;
+	uint32_t cpu, n = 0;
+	int node;
+	FILE* fp;
+
+	mask = vcalloc(ncpus, sizeof(*mask));
+	placed = vcalloc(ncpus, sizeof(*placed));
+
+	for (node = 0; node < ncpus; node++) {
+		fp = fopenf("r", "/sys/devices/system/node/node%d/cpulist", node);
+		if (!fp)
+			continue;
+
+		if (fgets(line, sizeof(line), fp) && !cpulist_parse(line, mask, ncpus)) {
+			for (cpu = 0; cpu < ncpus; cpu++) {
+				if (mask[cpu] && !placed[cpu]) {
+					placed[cpu] = true;
+					order[n++] = cpu;
+				}
+			}
+		}
+		fclose(fp);
+	}
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		if (!placed[cpu])
+			order[n++] = cpu;
+	}
+
+	free(mask);
+	free(placed);
+}
+
+int evpipe_readers_start(evpipe_t* evp, int nreaders, int timeout) {
+	evreader_t* rd;
+	evqueue_t* q;
+	uint32_t* order, per, i;
+	int r, err;
+
+	if (evp->ringbuf || nreaders < 1)
+		return 0;
+
+	if (nreaders > evp->ncpus)
+		nreaders = evp->ncpus;
+
+	order = vcalloc(evp->ncpus, sizeof(*order));
+	cpus_by_node(order, evp->ncpus);
+
+	pthread_mutex_init(&evp->lock, NULL);
+	pthread_cond_init(&evp->cond, NULL);
+	evp->timeout = timeout;
+	evp->nreaders = nreaders;
+	evp->rd = vcalloc(nreaders, sizeof(*evp->rd));
+	per = (evp->ncpus + nreaders - 1) / nreaders;
+
+	for (r = 0; r < nreaders; r++) {
+		rd = &evp->rd[r];
+		rd->evp = evp;
+		rd->cpus = &order[r * per];
+		rd->ncpus = (r + 1) * per > evp->ncpus ? evp->ncpus - r * per : per;
+
+		rd->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (rd->epfd < 0)
+			return -errno;
+
+		for (i = 0; i < rd->ncpus; i++) {
+			q = &evp->q[rd->cpus[i]];
+			q->rd = rd;
+
+			err = evpipe_watch(rd->epfd, q->fd, q);
+			if (err)
+				return err;
+		}
+	}
+
+	for (r = 0; r < nreaders; r++) {
+		err = pthread_create(&evp->rd[r].thread, NULL, evreader_run, &evp->rd[r]);
+		if (err) {
+			verror("could not start reader thread");
+			return -err;
+		}
+	}
+
+	return 0;
+}
+
+int evpipe_timer_add(evpipe_t* evp, uint64_t ms, void (*fn)(void* arg), void* arg) {
+	struct itimerspec its = {};
+	evtimer_t* t;
+
+	if (evp->ntimers == EVPIPE_MAX_TIMERS)
+		return -ENOSPC;
+
+	t = &evp->timers[evp->ntimers];
+	t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (t->fd < 0)
+		return -errno;
+
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	its.it_interval = its.it_value;
+
+	if (timerfd_settime(t->fd, 0, &its, NULL)) {
+		close(t->fd);
+		return -errno;
+	}
+
+	t->fn = fn;
+	t->arg = arg;
+	evp->ntimers++;
+
+	/* with reader threads nobody waits on epfd, the merge loop polls
+	 * the timers after every round instead */
+	return evpipe_watch(evp->epfd, t->fd, t);
+}
+
+static int evpipe_is_timer(evpipe_t* evp, void* ptr) {
+	return ptr >= (void*)evp->timers && ptr < (void*)(evp->timers + evp->ntimers);
+}
+
+/* timers that expired more than once while we were busy still only
+ * run once, an interval is the time since its last run. */
+static void evpipe_timers_run(evpipe_t* evp) {
+	uint64_t expired;
+	int i;
+
+	for (i = 0; i < evp->ntimers; i++) {
+		if (read(evp->timers[i].fd, &expired, sizeof(expired)) != sizeof(expired))
+			continue;
+
+		evp->timers[i].fn(evp->timers[i].arg);
+	}
+}
+
+static int evrec_cmp(const void* a, const void* b) {
+	const event_t* ea = *(event_t* const*)a;
+	const event_t* eb = *(event_t* const*)b;
+
+	if (ea->ts != eb->ts)
+		return ea->ts < eb->ts ? -1 : 1;
+
+	return 0;
+}
+
+#define evrec_foreach(_size, _ev, _buf, _at)				\
+	for ((_at) = 0;							\
+	     (_at) < (_buf)->len &&					\
+		((_size) = *(uint64_t*)((_buf)->data + (_at)),		\
+		 (_ev) = (void*)((_buf)->data + (_at) + sizeof(uint64_t)), 1); \
+	     (_at) += sizeof(uint64_t) + _ALIGNED(_size))
+
+/* hand every record older than the oldest reader horizon to its
+ * handler in timestamp order, the rest waits for the next round. */
+static struct ret_value evpipe_merge(evpipe_t* evp, int final) {
+	struct ret_value ret = {};
+	uint64_t safe = UINT64_MAX, size;
+	evreader_t* rd;
+	event_t* ev;
+	vec_t* ready;
+	size_t at, keep, rec;
+	int r, i;
+
+	pthread_mutex_lock(&evp->lock);
+	for (r = 0; r < evp->nreaders; r++) {
+		rd = &evp->rd[r];
+		evbuf_push(&rd->backlog, rd->pending.data, rd->pending.len);
+		rd->pending.len = 0;
+
+		if (rd->horizon < safe)
+			safe = rd->horizon;
+	}
+	pthread_mutex_unlock(&evp->lock);
+
+	if (final)
+		safe = UINT64_MAX;
+
+	/* kept across rounds, only its length is reset */
+	if (!evp->ready)
+		evp->ready = vec_new();
+	ready = evp->ready;
+	ready->len = 0;
+
+	for (r = 0; r < evp->nreaders; r++) {
+		evrec_foreach(size, ev, &evp->rd[r].backlog, at) {
+			if (ev->ts <= safe)
+				vec_push(ready, ev);
+		}
+	}
+
+	qsort(ready->data, ready->len, sizeof(*ready->data), evrec_cmp);
+
+	for (i = 0; i < ready->len; i++) {
+		ev = ready->data[i];
+		ret = event_handle(ev, ((uint64_t*)ev)[-1]);
+		if (ret.err | ret.exit)
+			break;
+	}
+
+	for (r = 0; r < evp->nreaders; r++) {
+		rd = &evp->rd[r];
+		keep = 0;
+
+		evrec_foreach(size, ev, &rd->backlog, at) {
+			if (ev->ts <= safe)
+				continue;
+
+			rec = sizeof(uint64_t) + _ALIGNED(size);
+			memmove(rd->backlog.data + keep, rd->backlog.data + at, rec);
+			keep += rec;
+		}
+		rd->backlog.len = keep;
+	}
+
+	obuf_flush();
+	return ret;
+}
+
+static struct ret_value evpipe_merge_loop(evpipe_t* evp, int* sig, int timeout) {
+	struct ret_value ret = {};
+	struct timespec ts;
+	int wait;
+
+	for (;!(*sig);) {
+		wait = evpipe_flush_due(evp, timeout);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += wait / 1000;
+		ts.tv_nsec += (wait % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&evp->lock);
+		if (wait < 0)
+			pthread_cond_wait(&evp->cond, &evp->lock);
+		else
+			pthread_cond_timedwait(&evp->cond, &evp->lock, &ts);
+		pthread_mutex_unlock(&evp->lock);
+
+		ret = evpipe_merge(evp, 0);
+		if (ret.err | ret.exit)
+			return ret;
+
+		evpipe_timers_run(evp);
+
+		/* readers publishing all the time must not keep the caller
+		 * from its periodic work */
+		if (!evpipe_flush_due(evp, timeout)) {
+			evp->flushed = clock_ns();
+			return ret;
+		}
+	}
+
+	return ret;
+}
+
 struct ret_value evpipe_loop(evpipe_t* evp, int* sig, int timeout) {
-	struct ret_value ret;
-	int cpu, ready;
+	struct ret_value ret = {};
+	int i, ready, wait;
 
+	if (evp->nreaders)
+		return evpipe_merge_loop(evp, sig, timeout);
+
+	/* a busy cpu or a short interval timer keeps epoll_wait from ever
+	 * timing out, so the flush runs on a deadline instead, and the
+	 * caller gets control back every time it does. */
 	for (;!(*sig);) {
-		ready = poll(evp->poll, evp->ncpus, timeout);
+		wait = evpipe_flush_due(evp, timeout);
+		if (!wait)
+			return evpipe_flush(evp);
+
+		ready = epoll_wait(evp->epfd, evp->events, evp->ncpus, wait);
 		
 		if (ready < 0) {
 			ret.err = 1;
@@ -186,41 +735,325 @@ struct ret_value evpipe_loop(evpipe_t* evp, int* sig, int timeout) {
 			return ret;
 		} 
 
-		if (timeout == -1) {
-			assert(ready);
-		} else if (ready == 0) {
-			return ret;
-		}
-
-		for (cpu = 0; ready && (cpu < evp->ncpus); cpu++) {
-			if (!(evp->poll[cpu].revents & POLLIN))
+		for (i = 0; i < ready; i++) {
+			if (evpipe_is_timer(evp, evp->events[i].data.ptr))
 				continue;
-			ret = evqueue_drain(&evp->q[cpu]);
+
+			ret = evpipe_drain(evp, evp->events[i].data.ptr);
 			
 			if (ret.err | ret.exit) 
-				return ret;
-
-			ready--;
+				break;
 		}
+
+		obuf_flush();
+		if (ret.err | ret.exit)
+			return ret;
+
+		evpipe_timers_run(evp);
 	}
 	return ret;
 }
 
-static void __key_workaround(int fd, void* key, size_t key_sz, void* val) {
+void evpipe_stop(evpipe_t* evp) {
+	int r;
+
+	if (!evp->nreaders) {
+		evpipe_flush(evp);
+		evfile_close();
+		return;
+	}
+
+	__atomic_store_n(&evp->stop, 1, __ATOMIC_RELAXED);
+	for (r = 0; r < evp->nreaders; r++)
+		pthread_join(evp->rd[r].thread, NULL);
+
+	evpipe_merge(evp, 1);
+	evfile_close();
+}
+
+/* recordings are the header built by evfile_open() followed by the
+ * records, in the same size + padded event layout as the merge stage
+ * uses. the file is mapped and grown in place so that appending a
+ * record is a copy, formatting is left to evfile_decode(). */
+static int evfile_grow(evfile_t* f, size_t size) {
+	size_t cap = f->cap;
+	void* mem;
+
+	while (f->len + size > cap)
+		cap <<= 1;
+
+	if (cap == f->cap)
+		return 0;
+
+	if (ftruncate(f->fd, cap))
+		return -errno;
+
+	mem = mremap(f->mem, f->cap, cap, MREMAP_MAYMOVE);
+	if (mem == MAP_FAILED)
+		return -errno;
+
+	f->mem = mem;
+	f->cap = cap;
+	return 0;
+}
+
+static void evfile_append(evfile_t* f, event_t* ev, size_t size) {
+	uint64_t len = size;
+	uint8_t* p;
+
+	if (evfile_grow(f, sizeof(len) + _ALIGNED(size))) {
+		_e("recording full, dropping event");
+		return;
+	}
+
+	p = f->mem + f->len;
+	memcpy(p, &len, sizeof(len));
+	memcpy(p + sizeof(len), ev, size);
+	memset(p + sizeof(len) + size, 0, _ALIGNED(size) - size);
+	f->len += sizeof(len) + _ALIGNED(size);
+}
+
+int evfile_open(const char* path) {
+	evfile_hdr_t hdr = { .magic = EVFILE_MAGIC, .version = EVFILE_VERSION };
+	evfile_t* f;
 	FILE* fp;
-	int err;
+	char* meta;
+	size_t len;
+	uint64_t t, size;
 
-	fp = fopen("/dev/urandom", "r");
-	
-	while (1) {
-		err = bpf_map_lookup(fd, key, val);
-		if (err)
+	fp = open_memstream(&meta, &len);
+	if (!fp)
+		return -errno;
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (t = 0; t < next_type; t++) {
+		size = evh_table[t]->size;
+		fwrite(&t, sizeof(t), 1, fp);
+		fwrite(&size, sizeof(size), 1, fp);
+
+		if (evh_table[t]->save)
+			evh_table[t]->save(fp, evh_table[t]->priv);
+	}
+	fclose(fp);
+
+	hdr.nhandlers = next_type;
+	hdr.size = _ALIGNED(len);
+
+	f = vcalloc(1, sizeof(*f));
+	f->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (f->fd < 0) {
+		_e("could not create \"%s\"", path);
+		free(meta);
+		free(f);
+		return -errno;
+	}
+
+	for (f->cap = 1 << 20; f->cap < hdr.size; f->cap <<= 1);
+
+	if (ftruncate(f->fd, f->cap))
+		goto err;
+
+	f->mem = mmap(NULL, f->cap, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+	if (f->mem == MAP_FAILED)
+		goto err;
+
+	memcpy(f->mem, meta, len);
+	memcpy(f->mem, &hdr, sizeof(hdr));
+	f->len = hdr.size;
+
+	free(meta);
+	evfile = f;
+	return 0;
+
+err:
+	_e("could not map \"%s\"", path);
+	close(f->fd);
+	free(meta);
+	free(f);
+	return -errno;
+}
+
+void evfile_close(void) {
+	evfile_t* f = evfile;
+
+	if (!f)
+		return;
+
+	evfile = NULL;
+	munmap(f->mem, f->cap);
+
+	if (ftruncate(f->fd, f->len))
+		_e("could not trim recording");
+
+	close(f->fd);
+	free(f);
+}
+
+int evfile_decode(const char* path, evhandler_t* (*load)(FILE* fp)) {
+	evfile_hdr_t* hdr;
+	evhandler_t* evh;
+	struct stat st;
+	uint8_t* mem;
+	uint64_t t, type, size, offs;
+	FILE* fp;
+	int fd, err = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		_e("could not open \"%s\"", path);
+		return -errno;
+	}
+
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return -errno;
+
+	hdr = (void*)mem;
+	if ((size_t)st.st_size < sizeof(*hdr) || memcmp(hdr->magic, EVFILE_MAGIC, sizeof(EVFILE_MAGIC)) ||
+	    hdr->version != EVFILE_VERSION || hdr->size > (size_t)st.st_size) {
+		_e("\"%s\" is not a recording", path);
+		err = -EINVAL;
+		goto out;
+	}
+
+	fp = fmemopen(mem + sizeof(*hdr), hdr->size - sizeof(*hdr), "r");
+	if (!fp) {
+		err = -errno;
+		goto out;
+	}
+
+	for (t = 0; t < hdr->nhandlers; t++) {
+		if (fread(&type, sizeof(type), 1, fp) != 1 ||
+		    fread(&size, sizeof(size), 1, fp) != 1)
 			break;
 
-		if (fread(key, key_sz, 1, fp) != 1)
+		evh = load(fp);
+		if (!evh || evh->type != type)
 			break;
+
+		evh->size = size;
 	}
 	fclose(fp);
+
+	if (t != hdr->nhandlers) {
+		_e("corrupt handler table in \"%s\"", path);
+		err = -EINVAL;
+		goto out;
+	}
+
+	for (offs = hdr->size; offs + sizeof(size) <= (size_t)st.st_size;) {
+		memcpy(&size, mem + offs, sizeof(size));
+		offs += sizeof(size);
+
+		if (!size || offs + size > (size_t)st.st_size)
+			break;
+
+		if (event_handle((event_t*)(mem + offs), size).err) {
+			err = -EINVAL;
+			break;
+		}
+
+		offs += _ALIGNED(size);
+	}
+
+	obuf_flush();
+out:
+	munmap(mem, st.st_size);
+	return err;
+}
+
+int evpipe_probe_add(evpipe_t* evp, const char* name) {
+	evlost_t* l = &evp->lost;
+
+	if (l->fd < 0 || l->nprobes == EVPIPE_MAX_PROBES)
+		return -1;
+
+	l->probes[l->nprobes] = vstr((char*)name);
+	return l->nprobes++;
+}
+
+/* a bigger queue can only be had by dropping the old mapping, which
+ * detaches the perf buffer, so whatever is left in it is drained first
+ * and events written while we remap are lost (and counted). */
+static void evqueue_grow(evqueue_t* q) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	void* mem;
+
+	if (q->size >= EVQUEUE_MAX_SIZE)
+		return;
+
+	evqueue_drain(q);
+	munmap(q->mem, q->size + page);
+
+	mem = mmap(NULL, 2 * q->size + page, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0);
+	if (mem != MAP_FAILED) {
+		q->size *= 2;
+	} else {
+		mem = mmap(NULL, q->size + page, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0);
+		if (mem == MAP_FAILED)
+			verror("could not remap queue");
+	}
+
+	q->mem = mem;
+	_pr_debug("queue grown to %zu bytes\n", q->size);
+}
+
+#define EVPIPE_REPORT_NS 1000000000ULL
+
+void evpipe_lost_report(evpipe_t* evp, int final) {
+	evlost_t* l = &evp->lost;
+	int ncpus = cpus_possible(), cpu, p;
+	uint64_t* val, *sum, total = 0, now = clock_ns();
+	uint32_t key;
+
+	if (l->fd < 0 || !l->nprobes)
+		return;
+
+	if (!final && now - l->ts < EVPIPE_REPORT_NS)
+		return;
+	l->ts = now;
+
+	val = vcalloc(ncpus, sizeof(*val));
+	sum = vcalloc(ncpus, sizeof(*sum));
+
+	for (key = 0; key < (uint32_t)l->nprobes; key++) {
+		if (bpf_map_lookup(l->fd, &key, val))
+			continue;
+
+		for (l->probe[key] = 0, cpu = 0; cpu < ncpus; cpu++) {
+			l->probe[key] += val[cpu];
+			sum[cpu] += val[cpu];
+		}
+		total += l->probe[key];
+	}
+
+	/* cpus that dropped since the last report are still overflowing */
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		if (sum[cpu] > l->cpu[cpu] && evp->grow && !evp->ringbuf &&
+		    !evp->nreaders && (uint32_t)cpu < evp->ncpus)
+			evqueue_grow(&evp->q[cpu]);
+		l->cpu[cpu] = sum[cpu];
+	}
+	free(sum);
+	free(val);
+
+	if (total == l->total && !(final && total))
+		return;
+
+	fprintf(stderr, "%slost %"PRIu64" events (+%"PRIu64")\n",
+		final ? "total: " : "", total, total - l->total);
+	l->total = total;
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		if (l->cpu[cpu])
+			fprintf(stderr, "  cpu%-3d %"PRIu64"\n", cpu, l->cpu[cpu]);
+	}
+
+	for (p = 0; p < l->nprobes; p++) {
+		if (l->probe[p])
+			fprintf(stderr, "  %-20s %"PRIu64"\n", l->probes[p], l->probe[p]);
+	}
 }
 
 void dump_str(FILE* fp, node_t* str, void* data) {
@@ -278,76 +1111,526 @@ void dump_rec(FILE* fp, node_t* rec, void* data, int len) {
 		fputs(" ]", fp);
 }
 
-int cmp_node(node_t* node, const void* a, const void* b) {
-	node_t* arg;
+/* map output is ordered by value, largest first, and then by key. how
+ * to compare is worked out once per dump from the key and value
+ * annotations, records are then only referred to by index. */
+typedef struct map_order {
+	smap_t* smap;
+	char* data;
+	size_t rsize, ksize, vsize;
+	int kstr, vstr;
+} map_order_t;
 
-	switch (node->annot.type) {
-	case TYPE_INT:
+/* the integer a value is ranked by, aggregations by what they print */
+static int64_t map_rank(smap_t* smap, const char* val) {
+	agg_stats_t s;
+	int64_t v;
+
+	if (smap->agg < AGG_SUM) {
+		memcpy(&v, val, sizeof(v));
+		return v;
+	}
+
+	memcpy(&s, val, sizeof(s));
+	switch (smap->agg) {
+	case AGG_SUM:
+		return s.sum;
+	case AGG_MIN:
+		return s.min;
+	case AGG_MAX:
+		return s.max;
+	case AGG_AVG:
+		return s.count ? s.sum / s.count : 0;
+	default:
+		return s.count;
+	}
+}
+
+static int cmp_int(const char* a, const char* b) {
+	int64_t ai, bi;
+
+	memcpy(&ai, a, sizeof(ai));
+	memcpy(&bi, b, sizeof(bi));
+	return (ai > bi) - (ai < bi);
+}
+
+static int cmp_rec(const map_order_t* o, uint32_t ai, uint32_t bi) {
+	const char* a = o->data + ai * o->rsize;
+	const char* b = o->data + bi * o->rsize;
+	int64_t ra, rb;
+	int cmp;
+
+	/* string values read best in alphabetical order */
+	if (o->vstr) {
+		cmp = strncmp(a + o->ksize, b + o->ksize, o->vsize);
+	} else {
+		ra = map_rank(o->smap, a + o->ksize);
+		rb = map_rank(o->smap, b + o->ksize);
+		cmp = (rb > ra) - (rb < ra);
+	}
+
+	if (cmp)
+		return cmp;
+
+	return o->kstr ? strncmp(a, b, o->ksize) : cmp_int(a, b);
+}
+
+static int cmp_idx(const void* a, const void* b, void* o) {
+	return cmp_rec(o, *(const uint32_t*)a, *(const uint32_t*)b);
+}
+
+static void heap_sift(map_order_t* o, uint32_t* heap, size_t len, size_t i) {
+	size_t child;
+	uint32_t tmp;
+
+	for (; (child = 2 * i + 1) < len; i = child) {
+		if (child + 1 < len && cmp_rec(o, heap[child + 1], heap[child]) > 0)
+			child++;
+
+		if (cmp_rec(o, heap[i], heap[child]) >= 0)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+	}
+}
+
+/* the first n of c records, in order. the kept ones are a heap with
+ * the last of them on top, so every record costs at most one
+ * O(log n) replacement instead of sorting all c. */
+static size_t map_top(map_order_t* o, uint32_t* heap, size_t c, size_t n) {
+	size_t i, len = c < n ? c : n;
+
+	for (i = 0; i < len; i++)
+		heap[i] = i;
+
+	for (i = len / 2; i-- > 0;)
+		heap_sift(o, heap, len, i);
+
+	for (i = len; i < c; i++) {
+		if (cmp_rec(o, i, heap[0]) < 0) {
+			heap[0] = i;
+			heap_sift(o, heap, len, 0);
+		}
+	}
+
+	qsort_r(heap, len, sizeof(*heap), cmp_idx, o);
+	return len;
+}
+
+/* a full sort of integer ranks is an lsd radix sort on the rank, flipped
+ * so that the largest comes first. digits that are the same for every
+ * record are skipped, runs of equal ranks are put in key order after. */
+static void map_radix(map_order_t* o, uint32_t* order, size_t c) {
+	uint64_t* rank, *rtmp, *swap;
+	uint32_t* idx, *itmp, *iswap;
+	size_t count[256], i, j, sum, shift;
+
+	if (c < 2) {
+		if (c)
+			order[0] = 0;
+		return;
+	}
+
+	rank = vmalloc(c * sizeof(*rank));
+	rtmp = vmalloc(c * sizeof(*rtmp));
+	itmp = vmalloc(c * sizeof(*itmp));
+	idx = order;
+
+	for (i = 0; i < c; i++) {
+		rank[i] = ~((uint64_t)map_rank(o->smap, o->data + i * o->rsize + o->ksize)
+			^ (1ULL << 63));
+		idx[i] = i;
+	}
+
+	for (shift = 0; shift < 64; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < c; i++)
+			count[(rank[i] >> shift) & 0xff]++;
+
+		if (count[(rank[0] >> shift) & 0xff] == c)
+			continue;
+
+		for (sum = 0, i = 0; i < 256; i++) {
+			j = count[i];
+			count[i] = sum;
+			sum += j;
+		}
+
+		for (i = 0; i < c; i++) {
+			j = count[(rank[i] >> shift) & 0xff]++;
+			rtmp[j] = rank[i];
+			itmp[j] = idx[i];
+		}
+
+		swap = rank, rank = rtmp, rtmp = swap;
+		iswap = idx, idx = itmp, itmp = iswap;
+	}
+
+	if (idx != order) {
+		memcpy(order, idx, c * sizeof(*idx));
+		itmp = idx;
+	}
+
+	for (i = 0; i < c; i = j) {
+		for (j = i + 1; j < c && rank[j] == rank[i]; j++);
+		if (j - i > 1)
+			qsort_r(order + i, j - i, sizeof(*order), cmp_idx, o);
+	}
+
+	free(rank);
+	free(rtmp);
+	free(itmp);
+}
+
+/* per-cpu maps hand back one value per possible cpu, counters are
+ * added up into the single value that is printed. */
+static void map_stats_combine(smap_t* smap, void* val, const void* pval) {
+	size_t stride = _ALIGNED(smap->vsize);
+	int cpu, ncpus = cpus_possible();
+	agg_stats_t acc = {}, s;
+
+	for (cpu = 0; cpu < ncpus; cpu++) {
+		memcpy(&s, pval + cpu * stride, sizeof(s));
+		if (!s.count)
+			continue;
+
+		if (!acc.count || s.min < acc.min)
+			acc.min = s.min;
+		if (!acc.count || s.max > acc.max)
+			acc.max = s.max;
+
+		acc.count += s.count;
+		acc.sum += s.sum;
+	}
+
+	memcpy(val, &acc, sizeof(acc));
+}
+
+static void map_value_combine(smap_t* smap, void* val, const void* pval) {
+	size_t stride = _ALIGNED(smap->vsize), i;
+	int cpu, ncpus = cpus_possible();
+	int64_t sum, v;
+
+	if (smap->agg >= AGG_SUM) {
+		map_stats_combine(smap, val, pval);
+		return;
+	}
+
+	for (i = 0; i + sizeof(sum) <= smap->vsize; i += sizeof(sum)) {
+		for (sum = 0, cpu = 0; cpu < ncpus; cpu++) {
+			memcpy(&v, pval + cpu * stride + i, sizeof(v));
+			sum += v;
+		}
+		memcpy(val + i, &sum, sizeof(sum));
+	}
+}
+
+static int hist_cmp(const void* a, const void* b, void* _ksize) {
+	size_t ksize = *(size_t*)_ksize;
+	int64_t ab, bb;
+	int cmp;
+
+	cmp = memcmp(a, b, ksize);
+	if (cmp)
+		return cmp;
+
+	memcpy(&ab, a + ksize, sizeof(ab));
+	memcpy(&bb, b + ksize, sizeof(bb));
+	return (ab > bb) - (ab < bb);
+}
+
+static void dump_stats(FILE* fp, smap_t* smap, void* data) {
+	agg_stats_t s;
+
+	memcpy(&s, data, sizeof(s));
+
+	switch (smap->agg) {
+	case AGG_SUM:
+		fprintf(fp, "%8" PRId64, s.sum);
+		break;
+	case AGG_MIN:
+		fprintf(fp, "%8" PRId64, s.min);
 		break;
-	case TYPE_REC:
+	case AGG_MAX:
+		fprintf(fp, "%8" PRId64, s.max);
+		break;
+	case AGG_AVG:
+		fprintf(fp, "%8" PRId64, s.count ? s.sum / s.count : 0);
 		break;
 	default:
+		fprintf(fp, "count %" PRId64 ", avg %" PRId64 ", total %" PRId64
+			", min %" PRId64 ", max %" PRId64, s.count,
+			s.count ? s.sum / s.count : 0, s.sum, s.min, s.max);
 		break;
 	}
 }
 
-void cmp_map(const void* ak, const void* bk, void* _map) {
-	node_t* map = _map;
-	node_t* rec = map->map.args;
-	const void* av = ak + rec->annot.size;
-	const void* bv = bk + rec->annot.size;
-	int cmp;
+static void hist_row(FILE* fp, smap_t* smap, int64_t bucket, int64_t count, int64_t max) {
+	node_t* min, *hi, *step;
 
-	cmp = cmp_node(rec, ak, bk);
-	if (cmp)
-		return cmp_node(rec, ak, bk);
+	if (smap->agg == AGG_HIST) {
+		output_hist(fp, bucket, count, max);
+		return;
+	}
+
+	min = smap->method->call.args->next;
+	hi = min->next;
+	step = hi->next;
+	output_lhist(fp, bucket, min->integer, hi->integer, step->integer, count, max);
+}
+
+/* one histogram per user key, buckets between the lowest and highest
+ * one seen are printed even when empty. */
+static void map_dump_hist(smap_t* smap, char* data, int c, size_t rsize) {
+	node_t* arg = smap->map->map.args;
+	size_t ksize = arg->annot.size;
+	int64_t bucket, next, count, max;
+	char* rec, *end, *p;
+
+	qsort_r(data, c, rsize, hist_cmp, &ksize);
+
+	for (rec = data; rec < data + c * rsize; rec = end) {
+		max = 0;
+		for (end = rec; end < data + c * rsize && !memcmp(rec, end, ksize); end += rsize) {
+			memcpy(&count, end + smap->ksize, sizeof(count));
+			if (count > max)
+				max = count;
+		}
+
+		dump(stdout, arg, rec);
+		fputc('\n', stdout);
+
+		memcpy(&next, rec + ksize, sizeof(next));
+		for (p = rec; p < end; p += rsize) {
+			memcpy(&bucket, p + ksize, sizeof(bucket));
+			for (; next < bucket; next++)
+				hist_row(stdout, smap, next, 0, max);
+
+			memcpy(&count, p + smap->ksize, sizeof(count));
+			hist_row(stdout, smap, bucket, count, max);
+			next = bucket + 1;
+		}
+	}
+}
+
+/* a whole map is read into keys and vals, values as the kernel hands
+ * them out, i.e. one per possible cpu for per-cpu maps. batches are
+ * used when the kernel has them, get_next_key otherwise. */
+typedef struct map_buf {
+	char* keys, *vals;
+	size_t ksize, vsize;
+	size_t n, cap;
+} map_buf_t;
+
+static void map_buf_grow(map_buf_t* mb, size_t cap) {
+	mb->cap = cap;
+	mb->keys = vrealloc(mb->keys, cap * mb->ksize);
+	mb->vals = vrealloc(mb->vals, cap * mb->vsize);
+}
 
-	return cmp_node(map, av, bv);
+static int map_read_batch(int fd, map_buf_t* mb) {
+	uint64_t tokens[2][8], *in = NULL, *out = tokens[0];
+	uint32_t count;
+	int err;
+
+	for (;;) {
+		if (mb->n == mb->cap)
+			map_buf_grow(mb, mb->cap * 2);
+
+		count = mb->cap - mb->n;
+		err = bpf_map_lookup_batch(fd, in, out, mb->keys + mb->n * mb->ksize,
+				mb->vals + mb->n * mb->vsize, &count);
+		mb->n += count;
+
+		if (err == -ENOENT)
+			return 0;
+
+		/* a hash bucket did not fit in what was left */
+		if (err == -ENOSPC) {
+			map_buf_grow(mb, mb->cap * 2);
+			continue;
+		}
+
+		if (err)
+			return err;
+
+		in = out;
+		out = tokens[out == tokens[0]];
+	}
 }
 
-void map_dump(node_t* map) {
-	node_t* arg;
-	int err, c = 0;
-	size_t fd, rsize, ksize, vsize;
+static int map_read_iter(int fd, map_buf_t* mb) {
+	char* key = NULL;
+	int err;
+
+	for (err = bpf_map_next(fd, NULL, mb->keys); !err;
+	     err = bpf_map_next(fd, key, mb->keys + mb->n * mb->ksize)) {
+		key = mb->keys + mb->n * mb->ksize;
+
+		/* deleted since we got its key */
+		if (bpf_map_lookup(fd, key, mb->vals + mb->n * mb->vsize))
+			continue;
+
+		if (++mb->n == mb->cap) {
+			map_buf_grow(mb, mb->cap * 2);
+			key = mb->keys + (mb->n - 1) * mb->ksize;
+		}
+	}
+
+	return err == -ENOENT ? 0 : err;
+}
+
+static int map_read(smap_t* smap, map_buf_t* mb) {
+	int percpu = map_is_percpu(smap->type);
+	int err;
+
+	mb->ksize = smap->ksize;
+	mb->vsize = percpu ? _ALIGNED(smap->vsize) * cpus_possible() : smap->vsize;
+	mb->n = 0;
+	map_buf_grow(mb, 1024);
+
+	err = map_read_batch(smap->id, mb);
+	if (err && !mb->n) {
+		_pr_debug("batch lookup failed (%d), iterating\n", err);
+		err = map_read_iter(smap->id, mb);
+	}
+
+	return err;
+}
+
+static int mem_is_zero(const char* p, size_t size) {
+	while (size--) {
+		if (*p++)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* top limits the output to the largest values, 0 prints everything */
+void map_dump(smap_t* smap, size_t top) {
+	node_t* map = smap->map, *arg;
+	map_buf_t mb = {};
+	map_order_t o;
+	int percpu, c;
+	size_t i, n, rsize, ksize, vsize;
 	char* key, *val, *data;
+	uint32_t* order;
 
 	arg = map->map.args;
-	fd = map->annot.mapid;
-	ksize = arg->annot.size;
+	/* array keys are only the low half of the printed integer */
+	ksize = smap->ksize < arg->annot.size ? arg->annot.size : smap->ksize;
 	vsize = map->annot.size;	
 	rsize = ksize + vsize;
+	percpu = map_is_percpu(smap->type);
 
-	data = vmalloc(rsize * 1024);
-	key = data;
-	val = data + ksize;
-	
-	__key_workaround(fd, key, ksize, val);
-	
-	for (err = bpf_map_next(fd, key, key); !err; 
-		err = bpf_map_next(fd, key-rsize, key)) {
-		
-		err = bpf_map_lookup(fd, key, val);
-		if (err) 
-			goto out_free;
+	if (map_read(smap, &mb))
+		_e("could not read map %s", map->name);
+
+	data = vcalloc(mb.n + 1, rsize);
+	for (c = 0, i = 0; i < mb.n; i++) {
+		key = data + c * rsize;
+		val = key + ksize;
+
+		memcpy(key, mb.keys + i * smap->ksize, smap->ksize);
+		if (percpu)
+			map_value_combine(smap, val, mb.vals + i * mb.vsize);
+		else
+			memcpy(val, mb.vals + i * mb.vsize, vsize);
+
+		/* every array slot exists, only print the ones that were hit */
+		if (map_is_array(smap->type) && mem_is_zero(val, vsize))
+			continue;
 		c++;
+	}
+	free(mb.keys);
+	free(mb.vals);
 
-		key += rsize;
-		val += rsize;
+	if (smap->agg == AGG_HIST || smap->agg == AGG_LHIST) {
+		printf("\n%s\n", map->name);
+		map_dump_hist(smap, data, c, rsize);
+		goto out_free;
 	}
-	
-	qsort_r(data, c, rsize, cmp_map, map);
-	
-	printf("\n%s\n", map->name, c);
-	for (key = data, val = data+ksize; c > 0; c--) {
+
+	o.smap = smap;
+	o.data = data;
+	o.rsize = rsize;
+	o.ksize = ksize;
+	o.vsize = vsize;
+	o.kstr = arg->annot.type == TYPE_STR;
+	o.vstr = smap->agg == AGG_NONE && map->annot.type == TYPE_STR;
+
+	order = vmalloc((c + 1) * sizeof(*order));
+	if (top && top < c) {
+		n = map_top(&o, order, c, top);
+	} else if (!o.vstr) {
+		map_radix(&o, order, c);
+		n = c;
+	} else {
+		for (n = 0; n < c; n++)
+			order[n] = n;
+		qsort_r(order, c, sizeof(*order), cmp_idx, &o);
+	}
+
+	if (n < c)
+		printf("\n%s (top %zu of %d)\n", map->name, n, c);
+	else
+		printf("\n%s\n", map->name);
+
+	for (i = 0; i < n; i++) {
+		key = data + order[i] * rsize;
+		val = key + ksize;
+
 		dump(stdout, arg, key);
 		fputs("\t", stdout);
-		dump(stdout, map, val);
+		if (smap->agg >= AGG_SUM)
+			dump_stats(stdout, smap, val);
+		else
+			dump(stdout, map, val);
 		fputs("\n", stdout);
-		
-		key += rsize;
-		val += rsize;
 	}
+	free(order);
 
 out_free:
 	free(data);
-}
\ No newline at end of file
+}
+
+/* hash entries go with batched deletes, continuing one by one past
+ * keys that vanished in between. array slots cannot be deleted and
+ * are zeroed instead. */
+void map_clear(smap_t* smap) {
+	map_buf_t mb = {};
+	uint32_t count;
+	size_t i;
+	int err;
+
+	if (map_read(smap, &mb))
+		_e("could not read map %s", smap->map->name);
+
+	if (map_is_array(smap->type)) {
+		memset(mb.vals, 0, mb.vsize);
+		for (i = 0; i < mb.n; i++)
+			bpf_map_update(smap->id, mb.keys + i * mb.ksize, mb.vals, BPF_ANY);
+		goto out_free;
+	}
+
+	for (i = 0; i < mb.n; i += count + 1) {
+		count = mb.n - i;
+		err = bpf_map_delete_batch(smap->id, mb.keys + i * mb.ksize, &count);
+		if (!err)
+			break;
+
+		if (err != -ENOENT) {
+			_pr_debug("batch delete failed (%d), deleting one by one\n", err);
+			for (i += count; i < mb.n; i++)
+				bpf_map_delete(smap->id, mb.keys + i * mb.ksize, NULL);
+			break;
+		}
+	}
+
+out_free:
+	free(mb.keys);
+	free(mb.vals);
+}
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "cache.h"
+#include "ut.h"
+
+/* struct offsets and tracepoint formats only change with the kernel,
+ * so they are kept across runs in a text file keyed by the kernel's
+ * build id and the size and mtime of its BTF:
+ *
+ *   voyant-layout 2 <key>
+ *   s <struct> <field> <offset> <size> <signed> <type or ->
+ *   t <tracepoint> <nfields>
+ *   f <field> <offset> <size> <signed> <type>
+ *
+ * a file with any other key is ignored and replaced on save. */
+#define LAYOUT_VERSION 2
+
+typedef struct layout_member {
+	char* sname;
+	char* field;
+	struct_field_t f;
+} layout_member_t;
+
+static struct {
+	int loaded;
+	int dirty;
+	char key[128];
+	layout_member_t* members;
+	size_t nmembers;
+	tp_format_t** tps;
+	size_t ntps;
+} layout;
+
+tp_format_t* tp_format_new(const char* name) {
+	tp_format_t* fmt = vcalloc(1, sizeof(*fmt));
+
+	fmt->name = vstr((char*)name);
+	return fmt;
+}
+
+void tp_format_field(tp_format_t* fmt, const char* name, const char* type,
+		int offs, int size, int sign) {
+	tp_field_t* f;
+
+	fmt->fields = vrealloc(fmt->fields, (fmt->nfields + 1) * sizeof(*fmt->fields));
+	f = &fmt->fields[fmt->nfields++];
+
+	f->name = vstr((char*)name);
+	f->type = vstr((char*)type);
+	f->offs = offs;
+	f->size = size;
+	f->sign = sign;
+}
+
+/* the GNU build id note, or the release when the kernel has none */
+static void layout_key(char* key, size_t len) {
+	char id[65] = "", *p = id;
+	struct utsname uts;
+	struct stat st = {};
+	uint32_t note[3];
+	uint8_t buf[256];
+	size_t i, nsz, dsz;
+	FILE* fp;
+
+	fp = fopen("/sys/kernel/notes", "r");
+	while (fp && fread(note, sizeof(note), 1, fp) == 1) {
+		nsz = (note[0] + 3) & ~3;
+		dsz = (note[1] + 3) & ~3;
+		if (nsz + dsz > sizeof(buf) || fread(buf, nsz + dsz, 1, fp) != 1)
+			break;
+
+		if (note[2] == 3 && note[0] == 4 && !memcmp(buf, "GNU", 4)) {
+			for (i = 0; i < note[1] && i < 32; i++)
+				p += sprintf(p, "%02x", buf[nsz + i]);
+			break;
+		}
+	}
+	if (fp)
+		fclose(fp);
+
+	if (!*id && !uname(&uts))
+		snprintf(id, sizeof(id), "%s", uts.release);
+
+	stat("/sys/kernel/btf/vmlinux", &st);
+	snprintf(key, len, "%s-%lld-%lld", *id ? id : "unknown",
+		(long long)st.st_size, (long long)st.st_mtime);
+}
+
+/* VOYANT_CACHE names the file, set but empty turns the cache off */
+static int layout_path(char* path, size_t len) {
+	const char* env;
+
+	if ((env = getenv("VOYANT_CACHE")))
+		return !*env || snprintf(path, len, "%s", env) >= len;
+
+	if ((env = getenv("XDG_CACHE_HOME")) && *env)
+		return snprintf(path, len, "%s/voyant/layout", env) >= len;
+
+	if ((env = getenv("HOME")) && *env)
+		return snprintf(path, len, "%s/.cache/voyant/layout", env) >= len;
+
+	return -1;
+}
+
+static void layout_member_push(const char* sname, const char* field, const struct_field_t* f) {
+	layout_member_t* m;
+
+	layout.members = vrealloc(layout.members, (layout.nmembers + 1) * sizeof(*m));
+	m = &layout.members[layout.nmembers++];
+
+	m->sname = vstr((char*)sname);
+	m->field = vstr((char*)field);
+	m->f = *f;
+}
+
+static void layout_tp_push(tp_format_t* fmt) {
+	layout.tps = vrealloc(layout.tps, (layout.ntps + 1) * sizeof(*layout.tps));
+	layout.tps[layout.ntps++] = fmt;
+}
+
+static void layout_load(void) {
+	char path[PATH_MAX], line[512], key[128], a[128], b[128];
+	int version, offs, size, sign, at;
+	tp_format_t* tp = NULL;
+	struct_field_t f;
+	FILE* fp;
+
+	layout.loaded = 1;
+	layout_key(layout.key, sizeof(layout.key));
+
+	if (layout_path(path, sizeof(path)) || !(fp = fopen(path, "r")))
+		return;
+
+	if (!fgets(line, sizeof(line), fp)
+	    || sscanf(line, "voyant-layout %d %127s", &version, key) != 2
+	    || version != LAYOUT_VERSION || strcmp(key, layout.key)) {
+		_pr_debug("layout cache %s is for another kernel\n", path);
+		layout.dirty = 1;
+		fclose(fp);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+
+		switch (line[0]) {
+		case 's':
+			if (sscanf(line, "s %127s %127s %d %d %d %63s", a, b,
+				   &f.offs, &f.size, &f.sign, f.type) != 6)
+				break;
+
+			if (!strcmp(f.type, "-"))
+				f.type[0] = '\0';
+			layout_member_push(a, b, &f);
+			break;
+		case 't':
+			if (sscanf(line, "t %127s", a) == 1) {
+				tp = tp_format_new(a);
+				layout_tp_push(tp);
+			}
+			break;
+		case 'f':
+			at = 0;
+			if (tp && sscanf(line, "f %127s %d %d %d %n", a, &offs, &size, &sign, &at) == 4 && at)
+				tp_format_field(tp, a, line + at, offs, size, sign);
+			break;
+		default:
+			break;
+		}
+	}
+
+	fclose(fp);
+}
+
+int layout_cache_struct(const char* sname, const char* field, struct_field_t* f) {
+	layout_member_t* m;
+	size_t i;
+
+	if (!layout.loaded)
+		layout_load();
+
+	for (i = 0; i < layout.nmembers; i++) {
+		m = &layout.members[i];
+		if (!strcmp(m->sname, sname) && !strcmp(m->field, field)) {
+			*f = m->f;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+void layout_cache_struct_add(const char* sname, const char* field, const struct_field_t* f) {
+	layout_member_push(sname, field, f);
+	layout.dirty = 1;
+}
+
+tp_format_t* layout_cache_tp(const char* name) {
+	size_t i;
+
+	if (!layout.loaded)
+		layout_load();
+
+	for (i = 0; i < layout.ntps; i++) {
+		if (!strcmp(layout.tps[i]->name, name))
+			return layout.tps[i];
+	}
+
+	return NULL;
+}
+
+void layout_cache_tp_add(tp_format_t* fmt) {
+	layout_tp_push(fmt);
+	layout.dirty = 1;
+}
+
+/* written to a temporary file and renamed over the old one, so that
+ * concurrent runs never see half a cache */
+void layout_cache_save(void) {
+	char path[PATH_MAX], tmp[PATH_MAX + 16], *slash;
+	layout_member_t* m;
+	tp_format_t* tp;
+	tp_field_t* f;
+	size_t i;
+	int j;
+	FILE* fp;
+
+	if (!layout.dirty || layout_path(path, sizeof(path)))
+		return;
+
+	for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		mkdir(path, 0755);
+		*slash = '/';
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		_pr_debug("could not write layout cache %s\n", tmp);
+		return;
+	}
+
+	fprintf(fp, "voyant-layout %d %s\n", LAYOUT_VERSION, layout.key);
+
+	for (i = 0; i < layout.nmembers; i++) {
+		m = &layout.members[i];
+		fprintf(fp, "s %s %s %d %d %d %s\n", m->sname, m->field, m->f.offs,
+			m->f.size, m->f.sign, m->f.type[0] ? m->f.type : "-");
+	}
+
+	for (i = 0; i < layout.ntps; i++) {
+		tp = layout.tps[i];
+		fprintf(fp, "t %s %d\n", tp->name, tp->nfields);
+
+		for (j = 0; j < tp->nfields; j++) {
+			f = &tp->fields[j];
+			fprintf(fp, "f %s %d %d %d %s\n", f->name, f->offs, f->size, f->sign, f->type);
+		}
+	}
+
+	if (fclose(fp) || rename(tmp, path)) {
+		_pr_debug("could not write layout cache %s\n", path);
+		unlink(tmp);
+		return;
+	}
+
+	layout.dirty = 0;
+}
@@ -1,11 +1,27 @@
+#include <getopt.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "dsl.h"
+#include "cache.h"
+#include "func.h"
 #include "ut.h"
 
 static int term_sig = 0;
+static int use_perf = 0;
+static size_t wakeup_watermark = 1 << 10;
+static int flush_ms = 100;
+static size_t queue_size = 64 << 10;
+static int nreaders = 0;
+static int grow_queues = 0;
+static char* record_path = NULL;
+static symtable_t* interval_st;
+static size_t print_top = 0;
 static void term(int sig) {
     term_sig = sig;
     return;
@@ -31,11 +47,76 @@ void print_map(symtable_t* st) {
     int i;
     for (i = 0; i < st->len; i++) {
         if (st->table[i].type == SYM_MAP) {
-            map_dump(st->table[i].map->map);
+            map_dump(st->table[i].map, print_top);
         }
     }
 }
 
+static smap_t* interval_map(node_t* stmt) {
+    node_t* arg = stmt->call.args;
+    sym_t* sym;
+
+    if (!arg || arg->type != NODE_VAR)
+        verror("%s() expects a map", stmt->name);
+
+    sym = symtable_get(interval_st, arg->name);
+    if (!sym || sym->type != SYM_MAP)
+        verror("%s is not a map used by any probe", arg->name);
+
+    return sym->map;
+}
+
+/* print(m, n) shows the n largest values, print(m) follows --top */
+static size_t interval_top(node_t* stmt) {
+    node_t* n = stmt->call.args->next;
+
+    if (!n)
+        return print_top;
+
+    if (n->type != NODE_INT || n->next)
+        verror("print() takes a map and a number of entries");
+
+    return n->integer;
+}
+
+static void interval_run(void* arg) {
+    node_t* iv = arg, *stmt;
+    char stamp[16];
+    time_t now;
+
+    now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+    printf("\n%s\n", stamp);
+
+    _foreach(stmt, iv->interval.stmts) {
+        if (vstreq(stmt->name, "print"))
+            map_dump(interval_map(stmt), interval_top(stmt));
+        else
+            map_clear(interval_map(stmt));
+    }
+
+    fflush(stdout);
+}
+
+/* only print(m) and clear(m) run in user space, checked up front so
+ * a typo does not wait for the first tick */
+static void interval_add(evpipe_t* evp, node_t* iv) {
+    node_t* stmt;
+
+    _foreach(stmt, iv->interval.stmts) {
+        if (stmt->type != NODE_CALL
+            || (!vstreq(stmt->name, "print") && !vstreq(stmt->name, "clear")))
+            verror("interval blocks can only print() and clear() maps");
+
+        interval_map(stmt);
+        if (vstreq(stmt->name, "print"))
+            interval_top(stmt);
+    }
+
+    if (evpipe_timer_add(evp, iv->interval.ms, interval_run, iv))
+        verror("could not start a %zums interval", iv->interval.ms);
+}
+
 void _free(node_t* node) {
     node_t* head;
     vec_t* vec = vec_new();
@@ -57,14 +138,29 @@ void run(node_t* node) {
     node_t* head;
     ebpf_t* code;
     prog_t* prog;
+    struct ret_value ret;
     symtable_t* st = symtable_new();
     evpipe_t* evp = vcalloc(1, sizeof(*evp));
-    evpipe_init(evp, 4<<10);
+
+    evp->ringbuf = !use_perf && !nreaders;
+    evp->watermark = wakeup_watermark;
+    evp->grow = grow_queues;
+    evpipe_init(evp, queue_size);
+
+    /* declarations have to be known before the first probe uses a map */
+    _foreach(head, node) {
+        if (head->type == NODE_DEC)
+            map_spec_dec(st, head);
+    }
 
     _foreach(head, node) {
+        if (head->type == NODE_DEC || head->type == NODE_INTERVAL)
+            continue;
+
         code = ebpf_new();
         code->evp = evp;
         code->st = st;
+        code->probe = evpipe_probe_add(evp, head->probe.name);
 
         sema(head, code);
         prog = gen_prog(head);
@@ -73,29 +169,111 @@ void run(node_t* node) {
 
         attach(head, prog->ctx, head->probe.traceid);
     }
-    
+
+    /* offsets and formats resolved for the first time are kept for the next run */
+    layout_cache_save();
+
+    interval_st = st;
+    _foreach(head, node) {
+        if (head->type == NODE_INTERVAL)
+            interval_add(evp, head);
+    }
+
+    /* handler ids and record sizes are final once every probe is compiled */
+    if (record_path && evfile_open(record_path))
+        verror("could not record to %s", record_path);
+
+    evpipe_readers_start(evp, nreaders, flush_ms);
+
     siginterrupt(SIGINT, 1);
     signal(SIGINT, term);
-    evpipe_loop(evp, &term_sig, -1);
+
+    while (!term_sig) {
+        ret = evpipe_loop(evp, &term_sig, flush_ms);
+        if (ret.err)
+            break;
+
+        evpipe_lost_report(evp, 0);
+    }
+
+    evpipe_stop(evp);
+    evpipe_lost_report(evp, 1);
     print_map(st);
 }
 
 int main(int argc, char **argv) {
-    char* filename, *input;
+    char* filename, *input, *end;
     lexer_t* lexer;
     parser_t* parser;
     node_t* node;
-    ebpf_t* code;
-    prog_t* prog;
-    int id;
-    symtable_t* st;
+    int opt;
+    static struct option longopts[] = {
+        { "top", required_argument, NULL, 'T' },
+        {}
+    };
+
+    while ((opt = getopt_long(argc, argv, "C:Pw:t:q:j:o:gc", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'T':
+            print_top = strtoul(optarg, NULL, 0);
+            break;
+        case 'C':
+            if (bpf_probe_cpus(optarg))
+                verror("invalid cpu list: %s", optarg);
+            break;
+        case 'P':
+            use_perf = 1;
+            break;
+        case 'w':
+            wakeup_watermark = strtoul(optarg, NULL, 0);
+            /* compared against in the program as a 32-bit immediate */
+            if (wakeup_watermark > INT32_MAX)
+                verror("invalid watermark: %s", optarg);
+            break;
+        case 't':
+            flush_ms = strtol(optarg, NULL, 0);
+            break;
+        case 'j':
+            nreaders = strtol(optarg, NULL, 0);
+            break;
+        case 'c':
+            map_percpu = 1;
+            break;
+        case 'g':
+            grow_queues = 1;
+            break;
+        case 'o':
+            record_path = optarg;
+            break;
+        case 'q':
+            queue_size = strtoul(optarg, &end, 0);
+            switch (*end) {
+            case 'k': case 'K':
+                queue_size <<= 10;
+                break;
+            case 'm': case 'M':
+                queue_size <<= 20;
+                break;
+            default:
+                break;
+            }
+            break;
+        default:
+            verror("usage: voyant [-C cpulist] [-P] [-w bytes] [-t ms] [-q size] [-j readers] [-g] [-c] [-o file] [--top n] file\n"
+                   "       voyant decode file");
+        }
+    }
+
+    if (optind == argc - 2 && !strcmp(argv[optind], "decode"))
+        return evfile_decode(argv[optind + 1], out_load) ? 1 : 0;
 
-    if (argc != 2) {
-        verror("should have the two args");
+    if (optind != argc - 1) {
+        verror("usage: voyant [-C cpulist] [-P] [-w bytes] [-t ms] [-q size] [-j readers] [-g] [-c] [-o file] [--top n] file\n"
+                   "       voyant decode file");
         return 0;
     }
 
-    filename = argv[1];
+    filename = argv[optind];
     input = read_file(filename);
 
     if (!input) {
@@ -1,7 +1,12 @@
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "func.h"
+#include "ir.h"
 #include "buffer.h"
 #include "ut.h"
 
@@ -15,61 +20,322 @@ static int annot_rstr(node_t* n) {
 	n->annot.size = _ALIGNED(16);
 }
 
-static void printf_spec(const char* spec, const char* term, void* data, node_t* arg) {
-	int64_t num;
-	size_t fmt_len;
-	char* fmt;
+typedef enum fmt_kind {
+	FMT_LIT,
+	FMT_INT,
+	FMT_STR,
+	FMT_SPEC_INT,
+	FMT_SPEC_STR,
+} fmt_kind_t;
+
+typedef struct fmt_op {
+	fmt_kind_t kind;
+	char conv;
+	char* str;
+	size_t len;
+	node_t* arg;
+	size_t offs;
+	size_t size;
+	int prec;
+} fmt_op_t;
+
+typedef struct fmt {
+	char* str;
+	node_t* args;
+	fmt_op_t* ops;
+	int nops;
+	int resolved;
+} fmt_t;
+
+static fmt_op_t* fmt_op_add(fmt_t* fmt, fmt_kind_t kind, char* str, size_t len) {
+	fmt_op_t* op;
+
+	fmt->ops = vrealloc(fmt->ops, (fmt->nops + 1) * sizeof(*fmt->ops));
+	op = &fmt->ops[fmt->nops++];
+	memset(op, 0, sizeof(*op));
+
+	op->kind = kind;
+	op->str = str;
+	op->len = len;
+	return op;
+}
 
-	memcpy(&num, data, sizeof(num));
-	fmt_len = term - spec + 1;
-	fmt = strndup(spec, fmt_len);
-	
-	switch(*term) {
-	case 's':
-		printf(fmt, (char*)data);
-		break;
-	case 'd':
-		printf(fmt, (int)num);
-		break;
+/* record values are read back as 64 bits, so the length modifier of an
+ * integer spec is replaced by ll. the precision of a string spec is
+ * taken out into *prec and replaced by .*, so that it can be capped
+ * at the size of the value's slot. */
+static char* fmt_spec_compile(const char* spec, size_t len, char conv, int* prec) {
+	char* out = vcalloc(len + 4, 1);
+	char* o = out;
+	size_t i;
+
+	*prec = -1;
+	for (i = 0; i < len - 1; i++) {
+		if (strchr("hlLqjzt", spec[i]))
+			continue;
+
+		if (conv == 's' && spec[i] == '.') {
+			*prec = spec[i + 1] == '*' ? -1 : atoi(spec + i + 1);
+			while (i + 1 < len - 1 && (isdigit(spec[i + 1]) || spec[i + 1] == '*'))
+				i++;
+			continue;
+		}
+		*o++ = spec[i];
 	}
 
-	free(fmt);
+	if (conv == 's') {
+		*o++ = '.';
+		*o++ = '*';
+	} else if (conv != 'c') {
+		*o++ = 'l';
+		*o++ = 'l';
+	}
+
+	*o = conv;
+	return out;
 }
 
-static int event_output(event_t* ev, void* _call) {
-	node_t* arg, *call = _call;
-	char* fmt, *spec, *name, *str;
-	void* data = ev->data;
+static fmt_t* fmt_compile(char* str, node_t* args) {
+	fmt_t* fmt = vcalloc(1, sizeof(*fmt));
+	fmt_op_t* op;
+	char* lit, *p, *end;
+	node_t* arg = args;
 
-	name = call->call.args->name;
+	fmt->str = str;
+	fmt->args = args;
 
-	arg = call->call.args->next->rec.args->next; 
-	str = call->call.args->name;	
+	for (lit = p = str; *p; p++) {
+		if (*p != '%')
+			continue;
 
-	str_escape(str);	
-	
-	for (fmt = str; *fmt; fmt++) {
-		if (*fmt == '%' && arg) {
-			spec = fmt;
-			fmt = strpbrk(spec, "scd");
-			if (!fmt) 
-				break;
-			printf_spec(spec, fmt, data, arg);
-			
-			data += arg->annot.size;
-			arg = arg->next;
+		if (p[1] == '%') {
+			fmt_op_add(fmt, FMT_LIT, lit, p + 1 - lit);
+			lit = ++p + 1;
+			continue;
+		}
+
+		end = strpbrk(p + 1, "diouxXcs");
+		if (!end || !arg)
+			break;
+
+		if (p > lit)
+			fmt_op_add(fmt, FMT_LIT, lit, p - lit);
+
+		if (end == p + 1 && *end == 's') {
+			op = fmt_op_add(fmt, FMT_STR, NULL, 0);
+		} else if (end == p + 1 && *end != 'c') {
+			op = fmt_op_add(fmt, FMT_INT, NULL, 0);
+		} else {
+			op = fmt_op_add(fmt, *end == 's' ? FMT_SPEC_STR : FMT_SPEC_INT, NULL, 0);
+			op->str = fmt_spec_compile(p, end + 1 - p, *end, &op->prec);
+		}
+
+		op->conv = *end;
+		op->arg = arg;
+		arg = arg->next;
+		lit = p = end;
+		lit++;
+	}
+
+	if (*lit)
+		fmt_op_add(fmt, FMT_LIT, lit, strlen(lit));
+
+	return fmt;
+}
+
+/* argument sizes are only known once the record is annotated, which
+ * happens after annot_out(), so offsets are fixed on first use. */
+static void fmt_resolve(fmt_t* fmt) {
+	fmt_op_t* op;
+	node_t* arg;
+	size_t offs;
+	int i;
+
+	for (i = 0, op = fmt->ops; i < fmt->nops; i++, op++) {
+		if (op->kind == FMT_LIT)
+			continue;
+
+		for (offs = 0, arg = fmt->args; arg != op->arg; arg = arg->next)
+			offs = _REC_ALIGN(offs, arg->annot.size) + arg->annot.size;
+
+		op->offs = _REC_ALIGN(offs, op->arg->annot.size);
+		op->size = op->arg->annot.size;
+	}
+
+	fmt->resolved = 1;
+}
+
+static size_t fmt_u64(char* out, uint64_t num, int base, const char* digits) {
+	char tmp[24];
+	size_t n = 0, i;
+
+	do {
+		tmp[n++] = digits[num % base];
+		num /= base;
+	} while (num);
+
+	for (i = 0; i < n; i++)
+		out[i] = tmp[n - i - 1];
+
+	return n;
+}
+
+static void fmt_int(fmt_op_t* op, int64_t num) {
+	char* out = obuf_reserve(24);
+	size_t n = 0;
+
+	switch (op->conv) {
+	case 'd':
+	case 'i':
+		if (num < 0) {
+			out[n++] = '-';
+			n += fmt_u64(out + n, -(uint64_t)num, 10, "0123456789");
 		} else {
-			fputc(*fmt, stdout);
+			n = fmt_u64(out, num, 10, "0123456789");
+		}
+		break;
+	case 'u':
+		n = fmt_u64(out, num, 10, "0123456789");
+		break;
+	case 'o':
+		n = fmt_u64(out, num, 8, "01234567");
+		break;
+	case 'x':
+		n = fmt_u64(out, num, 16, "0123456789abcdef");
+		break;
+	case 'X':
+		n = fmt_u64(out, num, 16, "0123456789ABCDEF");
+		break;
+	}
+
+	obuf_commit(n);
+}
+
+/* narrow integers are struct fields, signed conversions extend them */
+static int64_t fmt_num(fmt_op_t* op, const void* data) {
+	bool sign = op->conv == 'd' || op->conv == 'i';
+	int64_t num;
+
+	switch (op->size) {
+	case 1:
+		return sign ? *(int8_t*)data : *(uint8_t*)data;
+	case 2:
+		return sign ? *(int16_t*)data : *(uint16_t*)data;
+	case 4:
+		return sign ? *(int32_t*)data : *(uint32_t*)data;
+	default:
+		memcpy(&num, data, sizeof(num));
+		return num;
+	}
+}
+
+static int event_output(event_t* ev, void* _fmt) {
+	fmt_t* fmt = _fmt;
+	fmt_op_t* op;
+	int64_t num;
+	void* data;
+	int i;
+
+	if (!fmt->resolved)
+		fmt_resolve(fmt);
+
+	for (i = 0, op = fmt->ops; i < fmt->nops; i++, op++) {
+		data = ev->data + op->offs;
+
+		switch (op->kind) {
+		case FMT_LIT:
+			obuf_write(op->str, op->len);
+			break;
+		case FMT_INT:
+			fmt_int(op, fmt_num(op, data));
+			break;
+		case FMT_STR:
+			obuf_write(data, strnlen(data, op->size));
+			break;
+		case FMT_SPEC_INT:
+			num = fmt_num(op, data);
+			if (op->conv == 'c')
+				obuf_printf(op->str, (int)num);
+			else
+				obuf_printf(op->str, num);
+			break;
+		case FMT_SPEC_STR:
+			if (op->prec >= 0 && (size_t)op->prec < op->size)
+				obuf_printf(op->str, op->prec, (char*)data);
+			else
+				obuf_printf(op->str, (int)op->size, (char*)data);
+			break;
 		}
 	}
+
 	return 0;
 }
 
+/* the format and argument layout are all that is needed to render an
+ * out() record, so that is what goes into a recording's header. */
+static void out_save(FILE* fp, void* priv) {
+	fmt_t* fmt = priv;
+	uint32_t len, nargs = 0, val;
+	node_t* arg;
+
+	len = strlen(fmt->str);
+	fwrite(&len, sizeof(len), 1, fp);
+	fwrite(fmt->str, len, 1, fp);
+
+	_foreach(arg, fmt->args)
+		nargs++;
+	fwrite(&nargs, sizeof(nargs), 1, fp);
+
+	_foreach(arg, fmt->args) {
+		val = arg->annot.type;
+		fwrite(&val, sizeof(val), 1, fp);
+		val = arg->annot.size;
+		fwrite(&val, sizeof(val), 1, fp);
+	}
+}
+
+evhandler_t* out_load(FILE* fp) {
+	evhandler_t* evh;
+	node_t* head = NULL, **next = &head, *arg;
+	uint32_t len, nargs, type, size;
+	char* str;
+
+	if (fread(&len, sizeof(len), 1, fp) != 1)
+		return NULL;
+
+	str = vcalloc(len + 1, 1);
+	if (len && fread(str, len, 1, fp) != 1)
+		return NULL;
+
+	if (fread(&nargs, sizeof(nargs), 1, fp) != 1)
+		return NULL;
+
+	for (; nargs; nargs--) {
+		if (fread(&type, sizeof(type), 1, fp) != 1 ||
+		    fread(&size, sizeof(size), 1, fp) != 1)
+			return NULL;
+
+		arg = node_int_new(0);
+		arg->annot.type = type;
+		arg->annot.size = size;
+		arg->next = NULL;
+
+		*next = arg;
+		next = &arg->next;
+	}
+
+	evh = vcalloc(1, sizeof(*evh));
+	evh->priv = fmt_compile(str, head);
+	evh->handle = event_output;
+	evh->save = out_save;
+
+	evhandler_register(evh);
+	return evh;
+}
+
 static int annot_out(node_t* call) {
 	evhandler_t* evh;
-	node_t* meta, *head, *varg, *rec;
-	size_t size; 
-	ssize_t addr;
+	node_t* meta, *varg, *rec;
 
 	varg = call->call.args;
 	if (!varg) {
@@ -78,18 +344,21 @@ static int annot_out(node_t* call) {
 	}
     
 	evh = vcalloc(1, sizeof(*evh));
-    evh->priv = call;
+	evh->priv = fmt_compile(str_escape(varg->name), varg->next);
 	evh->handle = event_output;
+	evh->save = out_save;
 	
 	evhandler_register(evh);	
 	
 	meta = node_int_new(evh->type);
 	meta->annot.type = TYPE_INT;
 	meta->annot.size = 8;
-	meta->next = varg->next;
+	meta->next = node_call_new(vstr("ns"), NULL);
+	meta->next->next = varg->next;
 	
 	rec = node_rec_new(meta);
 	varg->next = rec;
+	return 0;
 }
 
 static int annot_strcmp(node_t* call) {
@@ -206,16 +475,194 @@ int global_compile(node_t* n, ebpf_t* code, type_t type) {
 	return -1;
 }
 
-static int annot_hist(node_t* node) {
-	node_t* map = node->expr.left;
-	node_t* method = node->expr.right;
+/* map methods find the method's argument, if it has one, in r0 */
+static int annot_count(node_t* expr) {
+	return AGG_COUNT;
+}
+
+static int compile_count(node_t* expr, ebpf_t* code) {
+	node_t* map = expr->expr.left;
+
+	ebpf_emit_map_inc(code, map->annot.mapid, map->map.args->annot.addr,
+			map->annot.addr);
+	return 0;
+}
+
+/* log2 buckets are kept as separate entries keyed by the user's key
+ * followed by the bucket index. */
+static int annot_hist(node_t* expr) {
+	node_t* map = expr->expr.left;
+	node_t* arg = expr->expr.right->call.args;
+
+	if (!arg || arg->next || arg->annot.type != TYPE_INT)
+		verror("hist() takes one integer argument");
+
+	map->annot.ksize += sizeof(int64_t);
+	return AGG_HIST;
+}
+
+static int compile_hist(node_t* expr, ebpf_t* code) {
+	node_t* map = expr->expr.left;
+	node_t* args = map->map.args;
+
+	ebpf_emit(code, MOV(BPF_REG_1, BPF_REG_0));
+	emit_log2(code, BPF_REG_0, BPF_REG_1);
+	ebpf_emit(code, STXDW(BPF_REG_10, args->annot.addr + args->annot.size, BPF_REG_0));
+
+	ebpf_emit_map_inc(code, map->annot.mapid, args->annot.addr, map->annot.addr);
+	return 0;
+}
+
+static int annot_lhist(node_t* expr) {
+	node_t* map = expr->expr.left;
+	node_t* arg = expr->expr.right->call.args, *min, *max, *step;
+
+	if (!arg || arg->annot.type != TYPE_INT)
+		verror("lhist() takes an integer value");
+
+	min = arg->next;
+	max = min ? min->next : NULL;
+	step = max ? max->next : NULL;
+
+	if (!step || step->next || min->type != NODE_INT ||
+	    max->type != NODE_INT || step->type != NODE_INT)
+		verror("lhist() takes constant min, max and step");
+
+	if ((int64_t)step->integer <= 0 || (int64_t)max->integer <= (int64_t)min->integer ||
+	    (int32_t)min->integer != (int64_t)min->integer ||
+	    (int32_t)max->integer != (int64_t)max->integer)
+		verror("lhist() range is invalid");
+
+	map->annot.ksize += sizeof(int64_t);
+	return AGG_LHIST;
+}
+
+static int compile_lhist(node_t* expr, ebpf_t* code) {
+	node_t* map = expr->expr.left;
+	node_t* args = map->map.args;
+	node_t* min = expr->expr.right->call.args->next;
+	int64_t lo = min->integer, hi = min->next->integer;
+	int64_t step = min->next->next->integer;
+	int64_t nbuckets = (hi - lo + step - 1) / step;
+
+	ebpf_emit(code, MOV_IMM(BPF_REG_1, 0));
+	ebpf_emit(code, JMP_IMM(BPF_JSLT, BPF_REG_0, lo, 6));
+	ebpf_emit(code, MOV_IMM(BPF_REG_1, nbuckets + 1));
+	ebpf_emit(code, JMP_IMM(BPF_JSGE, BPF_REG_0, hi, 4));
+	ebpf_emit(code, MOV(BPF_REG_1, BPF_REG_0));
+	ebpf_emit(code, ALU_IMM(BPF_SUB, BPF_REG_1, lo));
+	ebpf_emit(code, ALU_IMM(BPF_DIV, BPF_REG_1, step));
+	ebpf_emit(code, ALU_IMM(BPF_ADD, BPF_REG_1, 1));
+	ebpf_emit(code, STXDW(BPF_REG_10, args->annot.addr + args->annot.size, BPF_REG_1));
+
+	ebpf_emit_map_inc(code, map->annot.mapid, args->annot.addr, map->annot.addr);
+	return 0;
+}
+
+static int annot_stats(node_t* expr) {
+	node_t* map = expr->expr.left;
+	node_t* method = expr->expr.right;
+	node_t* arg = method->call.args;
+	static const struct { const char* name; agg_t agg; } aggs[] = {
+		{ "sum", AGG_SUM }, { "min", AGG_MIN }, { "max", AGG_MAX },
+		{ "avg", AGG_AVG }, { "stats", AGG_STATS },
+	};
+	size_t i;
+
+	if (!arg || arg->next || arg->annot.type != TYPE_INT)
+		verror("%s() takes one integer argument", method->name);
+
+	map->annot.size = sizeof(agg_stats_t);
+
+	for (i = 0; i < sizeof(aggs) / sizeof(aggs[0]); i++) {
+		if (vstreq((char*)aggs[i].name, method->name))
+			return aggs[i].agg;
+	}
+
+	return -1;
+}
+
+/* all of these keep the full agg_stats_t, the map is per-cpu so the
+ * update is a plain read-modify-write. a miss stores the record that
+ * is prepared on the stack up front. */
+static int compile_stats(node_t* expr, ebpf_t* code) {
+	node_t* map = expr->expr.left;
+	ssize_t vaddr = map->annot.addr;
+	struct bpf_insn* miss, *done;
+
+	ebpf_emit(code, STXDW(BPF_REG_10, vaddr + offsetof(agg_stats_t, sum), BPF_REG_0));
+	ebpf_emit(code, STXDW(BPF_REG_10, vaddr + offsetof(agg_stats_t, min), BPF_REG_0));
+	ebpf_emit(code, STXDW(BPF_REG_10, vaddr + offsetof(agg_stats_t, max), BPF_REG_0));
+	ebpf_emit(code, MOV_IMM(BPF_REG_1, 1));
+	ebpf_emit(code, STXDW(BPF_REG_10, vaddr + offsetof(agg_stats_t, count), BPF_REG_1));
+
+	ebpf_emit_map_look(code, map->annot.mapid, map->map.args->annot.addr);
+	miss = code->ip;
+	ebpf_emit(code, JMP_IMM(BPF_JA, 0, 0, 0));
+
+	ebpf_emit(code, LDXDW(BPF_REG_1, vaddr + offsetof(agg_stats_t, sum), BPF_REG_10));
+
+	/* array slots exist before their first value */
+	ebpf_emit(code, LDXDW(BPF_REG_2, offsetof(agg_stats_t, count), BPF_REG_0));
+	ebpf_emit(code, JMP_IMM(BPF_JNE, BPF_REG_2, 0, 2));
+	ebpf_emit(code, STXDW(BPF_REG_0, offsetof(agg_stats_t, min), BPF_REG_1));
+	ebpf_emit(code, STXDW(BPF_REG_0, offsetof(agg_stats_t, max), BPF_REG_1));
+	ebpf_emit(code, ALU_IMM(BPF_ADD, BPF_REG_2, 1));
+	ebpf_emit(code, STXDW(BPF_REG_0, offsetof(agg_stats_t, count), BPF_REG_2));
+
+	ebpf_emit(code, LDXDW(BPF_REG_2, offsetof(agg_stats_t, sum), BPF_REG_0));
+	ebpf_emit(code, ALU(BPF_ADD, BPF_REG_2, BPF_REG_1));
+	ebpf_emit(code, STXDW(BPF_REG_0, offsetof(agg_stats_t, sum), BPF_REG_2));
+
+	ebpf_emit(code, LDXDW(BPF_REG_2, offsetof(agg_stats_t, min), BPF_REG_0));
+	ebpf_emit(code, JMP(BPF_JSLE, BPF_REG_2, BPF_REG_1, 1));
+	ebpf_emit(code, STXDW(BPF_REG_0, offsetof(agg_stats_t, min), BPF_REG_1));
+
+	ebpf_emit(code, LDXDW(BPF_REG_2, offsetof(agg_stats_t, max), BPF_REG_0));
+	ebpf_emit(code, JMP(BPF_JSGE, BPF_REG_2, BPF_REG_1, 1));
+	ebpf_emit(code, STXDW(BPF_REG_0, offsetof(agg_stats_t, max), BPF_REG_1));
+
+	done = code->ip;
+	ebpf_emit(code, JMP_IMM(BPF_JA, 0, 0, 0));
+
+	ebpf_emit_at(miss, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, code->ip - miss - 1));
+	ebpf_emit_map_update(code, map->annot.mapid, map->map.args->annot.addr,
+			vaddr, BPF_ANY);
+	ebpf_emit_at(done, JMP_IMM(BPF_JA, 0, 0, code->ip - done - 1));
+	return 0;
 }
 
 static builtin_t global_methods[] = {
-	builtin("count", annot_hist, NULL),
-	builtin("hist", annot_hist, NULL),
+	builtin("count", annot_count, compile_count),
+	builtin("hist", annot_hist, compile_hist),
+	builtin("lhist", annot_lhist, compile_lhist),
+	builtin("sum", annot_stats, compile_stats),
+	builtin("min", annot_stats, compile_stats),
+	builtin("max", annot_stats, compile_stats),
+	builtin("avg", annot_stats, compile_stats),
+	builtin("stats", annot_stats, compile_stats),
+	{}
 };
 
-int global_method(node_t* map) {
-	return 0;
-}
\ No newline at end of file
+/* returns the aggregation the method keeps in its map */
+int global_method_annot(node_t* expr) {
+	builtin_t* bi;
+
+	for (bi = global_methods; bi->name; bi++) {
+		if (vstreq((char*)bi->name, expr->expr.right->name))
+			return bi->annotate(expr);
+	}
+
+	return -1;
+}
+
+int global_method_compile(node_t* expr, ebpf_t* code) {
+	builtin_t* bi;
+
+	for (bi = global_methods; bi->name; bi++) {
+		if (vstreq((char*)bi->name, expr->expr.right->name))
+			return bi->compile(expr, code);
+	}
+
+	return -1;
+}
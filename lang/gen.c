@@ -1,3 +1,5 @@
+#include <stdlib.h>
+
 #include "func.h"
 #include "ir.h"
 
@@ -12,7 +14,6 @@ const struct bpf_insn if_then_insn =
 const struct bpf_insn if_else_insn =
 	JMP_IMM(BPF_JA, 0xf, INT32_MIN, INT16_MIN + 3);
 
-int gregs[3] =  {BPF_REG_6, BPF_REG_7, BPF_REG_8}; 
 
 #define LOG2_CMP(_bit)\
 	ebpf_emit(code, JMP_IMM(BPF_JSGE, src, (1<<(_bit)), 1));\
@@ -58,7 +59,7 @@ void compile_map_update(ebpf_t* code, node_t* var) {
     size = var->annot.ksize;
     fd = var->annot.mapid;
 
-    ebpf_emit_map_update(code, fd, kaddr, vaddr);
+    ebpf_emit_map_update(code, fd, kaddr, vaddr, BPF_ANY);
 }
 
 void compile_map_look(ebpf_t* code, node_t* map, ir_t* ir) {
@@ -75,30 +76,11 @@ void compile_map_look(ebpf_t* code, node_t* map, ir_t* ir) {
     ebpf_emit_read(code, vaddr, BPF_REG_0, vsize);
 
     if (map->annot.type == TYPE_INT) {
-        ebpf_emit(code, LDXDW(gregs[ir->r0->rn], vaddr, BPF_REG_10));
+        ebpf_emit(code, LDXDW(ir->r0->rn, vaddr, BPF_REG_10));
     }
 
 }
 
-void map_count(node_t* map, ebpf_t* code) {
-    int fd;
-    ssize_t kaddr, vaddr, vsize;
-
-    fd = map->annot.mapid;
-    kaddr = map->map.args->annot.addr;
-    vsize = map->annot.size;
-    vaddr = map->annot.addr;
-
-    ebpf_stack_zero(map, code, 0);
-
-    ebpf_emit_map_look(code, fd, kaddr);
-    ebpf_emit(code, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 8));
-    ebpf_emit_read(code, vaddr, BPF_REG_0, vsize);
-
-    ebpf_emit_count(code, vaddr);
-    ebpf_emit_map_update(code, fd, kaddr, vaddr);
-}
-
 void compile_comm(node_t* n, ebpf_t* e) {
 	size_t i;
 	
@@ -112,11 +94,70 @@ void compile_comm(node_t* n, ebpf_t* e) {
 	ebpf_emit(e, CALL(BPF_FUNC_get_current_comm));
 }
 
+/* bump this probe's drop counter, expects the failed helper's result
+ * to have been dealt with already. */
+void compile_lost(ebpf_t* code) {
+    ssize_t key;
+
+    if (code->probe < 0)
+        return;
+
+    code->sp -= sizeof(int64_t);
+    key = code->sp;
+
+    ebpf_emit(code, STW_IMM(BPF_REG_10, key, code->probe));
+    ebpf_emit_map_look(code, code->evp->lost.fd, key);
+    ebpf_emit(code, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 2));
+    ebpf_emit(code, MOV_IMM(BPF_REG_1, 1));
+    ebpf_emit(code, XADDDW(BPF_REG_0, 0, BPF_REG_1));
+}
+
+void compile_ring_rec(node_t* n, ebpf_t* code) {
+    struct bpf_insn* skip;
+    ssize_t addr, size;
+
+    addr = n->annot.addr;
+    size = n->annot.size;
+
+    ebpf_emit(code, MOV_IMM(BPF_REG_4, 0));
+
+    /* only wake the consumer once a watermark worth of data is queued */
+    if (code->evp->watermark) {
+        ebpf_emit_mapld(code, BPF_REG_1, code->evp->mapfd);
+        ebpf_emit(code, MOV_IMM(BPF_REG_2, BPF_RB_AVAIL_DATA));
+        ebpf_emit(code, CALL(BPF_FUNC_ringbuf_query));
+        ebpf_emit(code, MOV_IMM(BPF_REG_4, BPF_RB_FORCE_WAKEUP));
+        ebpf_emit(code, JMP_IMM(BPF_JGE, BPF_REG_0, code->evp->watermark, 1));
+        ebpf_emit(code, MOV_IMM(BPF_REG_4, BPF_RB_NO_WAKEUP));
+    }
+
+    /* the record is built on the stack, one call copies it into the ring */
+    ebpf_emit_mapld(code, BPF_REG_1, code->evp->mapfd);
+    ebpf_emit(code, MOV(BPF_REG_2, BPF_REG_10));
+    ebpf_emit(code, ALU_IMM(BPF_ADD, BPF_REG_2, addr));
+    ebpf_emit(code, MOV_IMM(BPF_REG_3, size));
+    ebpf_emit(code, CALL(BPF_FUNC_ringbuf_output));
+
+    if (code->probe < 0)
+        return;
+
+    skip = code->ip;
+    ebpf_emit(code, if_then_insn);
+    compile_lost(code);
+    ebpf_emit_at(skip, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, code->ip - skip - 1));
+}
+
 void compile_rec(node_t* n, ebpf_t* code) {
+    struct bpf_insn* skip;
     ssize_t addr, size;
     node_t* arg;
     int id;
 
+    if (code->evp->ringbuf) {
+        compile_ring_rec(n, code);
+        return;
+    }
+
     id = code->evp->mapfd;
     addr = n->annot.addr;
     size = n->annot.size;
@@ -130,6 +171,14 @@ void compile_rec(node_t* n, ebpf_t* code) {
 
     ebpf_emit(code, MOV_IMM(BPF_REG_5, size));
 	ebpf_emit(code, CALL(BPF_FUNC_perf_event_output));
+
+    if (code->probe < 0)
+        return;
+
+    skip = code->ip;
+    ebpf_emit(code, if_then_insn);
+    compile_lost(code);
+    ebpf_emit_at(skip, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, code->ip - skip - 1));
 }
 
 void compile_call(node_t* n, ebpf_t* e) {
@@ -176,7 +225,7 @@ void copy_data(ebpf_t* ebpf, ir_t* ir) {
     size = n->annot.size;
 
     if (n->annot.type == TYPE_INT) {
-        ebpf_emit(ebpf, LDXDW(gregs[ir->r0->rn], from, BPF_REG_10));
+        ebpf_emit(ebpf, LDXDW(ir->r0->rn, from, BPF_REG_10));
         return;
     }
 
@@ -198,7 +247,7 @@ void read_trace_args(ir_t* ir, ebpf_t* code) {
     switch (right->annot.type) {
     case TYPE_INT:
         ebpf_emit(code, LDXDW(BPF_REG_0, offs, BPF_REG_9));
-        ebpf_emit(code, MOV(gregs[ir->r0->rn], BPF_REG_0));
+        ebpf_emit(code, MOV(ir->r0->rn, BPF_REG_0));
         break;
     case TYPE_STR:
         ebpf_emit(code, MOV(BPF_REG_1, BPF_REG_10));
@@ -212,41 +261,62 @@ void read_trace_args(ir_t* ir, ebpf_t* code) {
     }
 }
 
+/* one probe_read_kernel per pointer followed, covering every field the
+ * probe reads through it. parents come first, so a pointer inside a
+ * parent's copy is already there when its read is made */
+void compile_struct_read(ebpf_t* ctx) {
+    ebpf_read_t* rd, *parent;
+    int i;
+
+    for (i = 0; i < ctx->nreads; i++) {
+        rd = &ctx->reads[i];
+
+        if (rd->parent < 0) {
+            ebpf_emit(ctx, LDXDW(BPF_REG_3, arch_reg_offs(rd->arg), BPF_REG_9));
+        } else {
+            parent = &ctx->reads[rd->parent];
+            ebpf_emit(ctx, LDXDW(BPF_REG_3, parent->addr + rd->poffs - parent->lo, BPF_REG_10));
+        }
+
+        ebpf_emit(ctx, MOV(BPF_REG_1, BPF_REG_10));
+        ebpf_emit(ctx, ALU_IMM(BPF_ADD, BPF_REG_1, rd->addr));
+        ebpf_emit(ctx, MOV_IMM(BPF_REG_2, rd->hi - rd->lo));
+        ebpf_emit(ctx, ALU_IMM(BPF_ADD, BPF_REG_3, rd->lo));
+        ebpf_emit(ctx, CALL(BPF_FUNC_probe_read_kernel));
+    }
+}
+
 void read_kprobe_args(ir_t* ir, ebpf_t* ctx) {
-    ssize_t o, size, addr, offs;
-    sym_t* sym;
+    ebpf_read_t* rd;
+    ssize_t addr;
     node_t* node;
-    char* name;
+    int dst, size;
 
     node = ir->value;
-    name = node->expr.left->name;
-    size = node->annot.size;
-    addr = node->annot.addr;
-    offs = node->annot.offs;
-    
-    sym = symtable_get(ctx->st, name);
+    rd = &ctx->reads[node->annot.read];
+    addr = rd->addr + node->annot.offs - rd->lo;
+    size = node->expr.right->annot.size;
+    dst = ir->r0->rn;
 
-    switch (sym->vannot.offs) {
-    case 0:
-        o = btf_get_field_off("pt_regs", "di");
-        break;
+    switch (size) {
     case 1:
-        o = btf_get_field_off("pt_regs", "si");
+        ebpf_emit(ctx, LDXB(dst, addr, BPF_REG_10));
         break;
     case 2:
-        o = btf_get_field_off("pt_regs", "dx");
-    default:
+        ebpf_emit(ctx, LDXH(dst, addr, BPF_REG_10));
         break;
+    case 4:
+        ebpf_emit(ctx, LDXW(dst, addr, BPF_REG_10));
+        break;
+    default:
+        ebpf_emit(ctx, LDXDW(dst, addr, BPF_REG_10));
+        return;
     }
 
-    ebpf_emit(ctx, LDXDW(BPF_REG_3, o, BPF_REG_9));
-    ebpf_emit(ctx, MOV(BPF_REG_1, BPF_REG_10));
-    ebpf_emit(ctx, ALU_IMM(BPF_ADD, BPF_REG_1, addr));
-    ebpf_emit(ctx, MOV_IMM(BPF_REG_2, size));
-    ebpf_emit(ctx, ALU_IMM(BPF_ADD, BPF_REG_3, offs));
-    ebpf_emit(ctx, CALL(BPF_FUNC_probe_read_kernel));
-
-    ebpf_emit(ctx, LDXDW(gregs[ir->r0->rn], addr, BPF_REG_10));
+    if (node->annot.sign) {
+        ebpf_emit(ctx, ALU_IMM(BPF_LSH, dst, 64 - 8 * size));
+        ebpf_emit(ctx, ALU_IMM(BPF_ARSH, dst, 64 - 8 * size));
+    }
 }
 
 //todo refactor
@@ -267,34 +337,44 @@ void compile_ir(ir_t* ir, ebpf_t* code) {
 
     switch (ir->op) {
     case IR_IMM:
-        ebpf_emit(code, MOV_IMM(gregs[r0], ir->imm));
+        ebpf_emit(code, MOV_IMM(r0, ir->imm));
+        break;
+    case IR_MOV:
+        if (r0 != r2)
+            ebpf_emit(code, MOV(r0, r2));
+        break;
+    case IR_LOAD_SPILL:
+        ebpf_emit(code, LDXDW(r0, ir->r2->slot, BPF_REG_10));
+        break;
+    case IR_STORE_SPILL:
+        ebpf_emit(code, STXDW(BPF_REG_10, ir->r0->slot, r2));
         break;
     case IR_SUB:
-        ebpf_emit(code, ALU(BPF_SUB, gregs[r0], gregs[r2]));
+        ebpf_emit(code, ALU(BPF_SUB, r0, r2));
         break;
     case IR_ADD:
-        ebpf_emit(code, ALU(BPF_ADD, gregs[r0], gregs[r2]));
+        ebpf_emit(code, ALU(BPF_ADD, r0, r2));
         break;
     case IR_EQ:
-        ebpf_emit_bool(code, BPF_JEQ, r0, r2);
+        ebpf_emit_bool(code, BPF_JEQ, r0, r0, r2);
         break;
     case IR_MUL:
-        ebpf_emit(code, ALU(BPF_MUL, gregs[r0], gregs[r2]));
+        ebpf_emit(code, ALU(BPF_MUL, r0, r2));
         break;
     case IR_DIV:
-        ebpf_emit(code, ALU(BPF_DIV, gregs[r0], gregs[r2]));
+        ebpf_emit(code, ALU(BPF_DIV, r0, r2));
         break;
     case IR_GT:
-        ebpf_emit_bool(code, BPF_JGT, r0, r2);
+        ebpf_emit_bool(code, BPF_JGT, r0, r0, r2);
         break;
     case IR_GE:
-        ebpf_emit_bool(code, BPF_JGE, r0, r2);
+        ebpf_emit_bool(code, BPF_JGE, r0, r0, r2);
         break;
     case IR_LT:
-        ebpf_emit_bool(code, BPF_JGT, r2, r0);
+        ebpf_emit_bool(code, BPF_JGT, r0, r2, r0);
         break;
     case IR_LE:
-        ebpf_emit_bool(code, BPF_JGE, r2, r0);
+        ebpf_emit_bool(code, BPF_JGE, r0, r2, r0);
         break;
     case IR_COPY:
         copy_data(code, ir);
@@ -304,10 +384,23 @@ void compile_ir(ir_t* ir, ebpf_t* code) {
         break;
     case IR_STORE:
         addr = ir->value->annot.addr;
-        ebpf_emit(code, STXDW(BPF_REG_10, addr, gregs[r2]));
+        ebpf_emit(code, STXDW(BPF_REG_10, addr, r2));
         break;
     case IR_ARG:
-        ebpf_emit(code, STXDW(BPF_REG_10, ir->addr, gregs[r0]));
+        switch (ir->size) {
+        case 1:
+            ebpf_emit(code, STXB(BPF_REG_10, ir->addr, r2));
+            break;
+        case 2:
+            ebpf_emit(code, STXH(BPF_REG_10, ir->addr, r2));
+            break;
+        case 4:
+            ebpf_emit(code, STXW(BPF_REG_10, ir->addr, r2));
+            break;
+        default:
+            ebpf_emit(code, STXDW(BPF_REG_10, ir->addr, r2));
+            break;
+        }
         break;
     case IR_MAP_UPDATE:
         compile_map_update(code, ir->value);
@@ -317,13 +410,13 @@ void compile_ir(ir_t* ir, ebpf_t* code) {
         break;
     case IR_RCALL:
         global_compile(ir->value, code, 0);
-        ebpf_emit(code, MOV(gregs[r0], BPF_REG_0));
+        ebpf_emit(code, MOV(r0, BPF_REG_0));
         break; 
     case IR_CALL:
         compile_call(ir->value, code); 
         break;
     case IR_BR:
-        ebpf_emit(code, MOV(BPF_REG_0, gregs[r2]));
+        ebpf_emit(code, MOV(BPF_REG_0, r2));
         break;
     case IR_IF_THEN:
         at = code->ip;
@@ -333,11 +426,21 @@ void compile_ir(ir_t* ir, ebpf_t* code) {
         ebpf_emit_at(at, JMP_IMM(BPF_JEQ, 0, 0, code->ip-at-1));
         break;
     case IR_MAP_METHOD:
-        map_count(ir->value, code);
+        if (ir->r2)
+            ebpf_emit(code, MOV(BPF_REG_0, r2));
+        global_method_compile(ir->value, code);
         break;
     case IR_READ:
         read_args(ir, code);
         break;
+    case IR_STRUCT_READ:
+        compile_struct_read(code);
+        break;
+    case IR_PRED:
+        ebpf_emit(code, JMP_IMM(BPF_JNE, r2, 0, 2));
+        ebpf_emit(code, MOV_IMM(BPF_REG_0, 0));
+        ebpf_emit(code, EXIT);
+        break;
     case IR_RETURN:
         ebpf_emit(code, MOV_IMM(BPF_REG_0, 0));
 	    ebpf_emit(code, EXIT);
@@ -347,7 +450,32 @@ void compile_ir(ir_t* ir, ebpf_t* code) {
     }
 }
 
+/* -C leaves the program on cpus outside the list. a range check per
+ * range: below it try the next one, inside it go on with the probe. */
+static void compile_cpu_filter(ebpf_t* e) {
+    int (*ranges)[2];
+    int i, n;
+
+    n = bpf_probe_cpu_ranges(NULL);
+    if (!n)
+        return;
+
+    ranges = vcalloc(n, sizeof(*ranges));
+    bpf_probe_cpu_ranges(ranges);
+
+    ebpf_emit(e, CALL(BPF_FUNC_get_smp_processor_id));
+    for (i = 0; i < n; i++) {
+        ebpf_emit(e, JMP_IMM(BPF_JLT, BPF_REG_0, ranges[i][0], 1));
+        ebpf_emit(e, JMP_IMM(BPF_JLE, BPF_REG_0, ranges[i][1], 2 * (n - i)));
+    }
+    ebpf_emit(e, MOV_IMM(BPF_REG_0, 0));
+    ebpf_emit(e, EXIT);
+
+    free(ranges);
+}
+
 void compile(prog_t* prog) {
+    reg_t* spilled;
     int i, j;
     bb_t* bb;
     ir_t* ir;
@@ -355,10 +483,32 @@ void compile(prog_t* prog) {
 
     e = prog->ctx;
 
+    /* every spilled value gets a stack slot of its own */
+    for (i = 0; i < prog->bbs->len; i++) {
+        bb = prog->bbs->data[i];
+        for (j = 0; j < bb->ir->len; j++) {
+            ir = bb->ir->data[j];
+            spilled = ir->op == IR_LOAD_SPILL ? ir->r2 : ir->op == IR_STORE_SPILL ? ir->r0 : NULL;
+
+            if (spilled && !spilled->slot) {
+                e->sp -= sizeof(int64_t);
+                spilled->slot = e->sp;
+            }
+        }
+    }
+
     ebpf_emit(e, MOV(BPF_CTX_REG, BPF_REG_1));
+    compile_cpu_filter(e);
+
+    /* the entry block holds the predicate, if any, so events that do
+     * not match leave before any data is put on the stack */
+    bb = prog->bbs->data[0];
+    for (j = 0; j < bb->ir->len; j++)
+        compile_ir(bb->ir->data[j], e);
+
     store_data(prog->data, e);
 
-    for (i = 0; i < prog->bbs->len; i++) {
+    for (i = 1; i < prog->bbs->len; i++) {
         bb = prog->bbs->data[i];     
         for (j = 0; j < bb->ir->len; j++) {
             ir = bb->ir->data[j];
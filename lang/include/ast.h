@@ -26,6 +26,7 @@ typedef enum node_type{
     NODE_STR,
     NODE_INT,
     NODE_CAST,
+    NODE_INTERVAL,
 } node_type;
 
 typedef struct node_t node_t;
@@ -38,9 +39,15 @@ typedef enum {
 typedef struct probe_t {
     char *name;
     int traceid;
+    node_t* pred;
     node_t* stmts;
 } probe_t;
 
+typedef struct interval_t {
+    size_t ms;
+    node_t *stmts;
+} interval_t;
+
 typedef struct call_t {
     node_t *args;
 } call_t;
@@ -123,6 +130,11 @@ typedef struct annot_t {
     ssize_t size;
     size_t offs;
 
+    /* struct fields: the read they are loaded from, and whether they
+     * are sign extended */
+    int read;
+    int sign;
+
     loc_t loc;
     ssize_t addr;
 } annot_t;
@@ -145,6 +157,7 @@ struct node_t {
 
     union{
         probe_t probe;
+        interval_t interval;
         infix_t expr;
         prefix_t pexpr;
         dec_t dec;
@@ -166,9 +179,11 @@ extern node_t *node_new(node_type t);
 extern node_t *node_probe_new(char *name, node_t *stmts);
 extern node_t *node_kprobe_new(char *name, node_t *stmts);
 extern node_t *node_test_new(char* name, node_t* stmts);
+extern node_t *node_interval_new(size_t ms, node_t* stmts);
 extern node_t *node_var_new(char *name);
 extern node_t *node_int_new(size_t name);
 extern node_t *node_str_new(char *str);
+extern node_t *node_call_new(char *name, node_t *args);
 extern node_t *node_expr_new(int opcode, node_t *left, node_t *right);
 extern node_t *node_if_new(node_t *cond, node_t *then, node_t *els);
 extern node_t *node_unroll_new(size_t count, node_t *stmts);
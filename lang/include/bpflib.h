@@ -8,11 +8,30 @@
 #include "ast.h"
 #include "ut.h"
 
+#define EBPF_MAX_READS 8
+#define EBPF_READ_SPAN 128
+
+/* the span of a struct that a probe reads fields from, copied to the
+ * stack with one probe_read_kernel on entry. the struct's address is
+ * a kprobe argument, or a pointer inside the copy of a parent read. */
+typedef struct ebpf_read_t {
+    const char* name;
+    int arg;
+    int parent;
+    ssize_t poffs;
+    ssize_t lo;
+    ssize_t hi;
+    ssize_t addr;
+} ebpf_read_t;
+
 typedef struct ebpf_t{
     char* name;
     ssize_t sp;
+    int probe;
     symtable_t *st;
     evpipe_t *evp;
+    ebpf_read_t reads[EBPF_MAX_READS];
+    int nreads;
     struct bpf_insn *ip;
     struct bpf_insn prog[BPF_MAXINSNS];
 } ebpf_t;
@@ -26,9 +45,14 @@ extern void ebpf_emit_at(struct bpf_insn *at, struct bpf_insn insn);
 extern void ebpf_value_copy(ebpf_t* code, ssize_t to, ssize_t from, size_t size);
 extern void ebpf_str_to_stack(ebpf_t *code, node_t *value);
 extern void ebpf_emit_map_look(ebpf_t* code, int fd, ssize_t kaddr);
-extern void ebpf_emit_map_update(ebpf_t* code, int fd, ssize_t kaddr, ssize_t vaddr);
+extern void ebpf_emit_map_update(ebpf_t* code, int fd, ssize_t kaddr, ssize_t vaddr, int flags);
+extern void ebpf_emit_map_inc(ebpf_t* code, int fd, ssize_t kaddr, ssize_t vaddr);
 extern void ebpf_emit_count(ebpf_t* code, ssize_t addr);
-extern void ebpf_emit_bool(ebpf_t* code, int op, int r0, int r2);
+extern void ebpf_emit_bool(ebpf_t* code, int op, int dst, int a, int b);
 extern void ebpf_emit_read(ebpf_t* code, ssize_t to, int from, size_t size);
+extern ebpf_read_t* ebpf_read_get(ebpf_t* code, const char* name);
+extern int ebpf_read_new(ebpf_t* code, const char* name, int parent, int arg, ssize_t poffs);
+extern int ebpf_read_span(ebpf_t* code, int read, ssize_t offs, size_t size);
+extern void ebpf_read_assign(ebpf_t* code);
 extern void ebpf_emit_read_str(ebpf_t* code, ssize_t to, int from, size_t size);
 #endif
\ No newline at end of file
@@ -1,19 +1,27 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/queue.h>
 #include <linux/perf_event.h>
 
 #include "ast.h"
+#include "ut.h"
 
 typedef struct event {
-	struct perf_event_header hdr;
-	uint32_t size;
 	uint64_t type;
+	uint64_t ts;
 	uint8_t data[0];
 }__attribute__((packed)) event_t;
 
+typedef struct sample {
+	struct perf_event_header hdr;
+	uint32_t size;
+	uint8_t data[0];
+}__attribute__((packed)) sample_t;
+
 typedef struct lost_event{
 	struct perf_event_header hdr;
 	uint64_t id;
@@ -21,23 +29,108 @@ typedef struct lost_event{
 } lost_event_t;
 
 typedef struct evhandler {
-	TAILQ_ENTRY(evhandler) node;
 	uint64_t type;
+	size_t size;
 	void* priv;
 	int (*handle)(event_t* ev, void* priv);
+	void (*save)(FILE* fp, void* priv);
 } evhandler_t;
 
+#define EVFILE_MAGIC "VYREC"
+#define EVFILE_VERSION 1
+
+struct smap_t;
+
+typedef struct evfile_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t nhandlers;
+	uint64_t size;
+} evfile_hdr_t;
+
+typedef struct evfile {
+	int fd;
+	uint8_t* mem;
+	size_t len, cap;
+} evfile_t;
+
+typedef struct evbuf {
+	uint8_t* data;
+	size_t len, cap;
+} evbuf_t;
+
+typedef struct evreader {
+	pthread_t thread;
+	struct evpipe* evp;
+	int epfd;
+	uint32_t* cpus;
+	uint32_t ncpus;
+	uint64_t horizon;
+	evbuf_t local;
+	evbuf_t pending;
+	evbuf_t backlog;
+} evreader_t;
+
 typedef struct evqueue {
 	int fd;
+	evreader_t* rd;
 	struct perf_event_mmap_page* mem;
+	size_t size;
 	void* buf;
 } evqueue_t;
 
+#define EVPIPE_MAX_PROBES 64
+#define EVQUEUE_MAX_SIZE (16 << 20)
+
+/* drops counted by the programs, per probe and cpu */
+typedef struct evlost {
+	int fd;
+	int nprobes;
+	char* probes[EVPIPE_MAX_PROBES];
+	uint64_t* cpu;
+	uint64_t* probe;
+	uint64_t total;
+	uint64_t ts;
+} evlost_t;
+
+#define EVPIPE_MAX_TIMERS 8
+
+/* user space work that is due every interval, run by the event loop */
+typedef struct evtimer {
+	int fd;
+	void (*fn)(void* arg);
+	void* arg;
+} evtimer_t;
+
+typedef struct evring {
+	size_t size;
+	unsigned long* consumer;
+	unsigned long* producer;
+	uint8_t* data;
+} evring_t;
+
 typedef struct evpipe {
 	int mapfd;
+	int ringbuf;
+	int epfd;
 	uint32_t ncpus;
-	struct pollfd* poll;
+	size_t watermark;
+	struct epoll_event* events;
+
+	int timeout;
+	uint64_t flushed;
+	int stop;
+	int nreaders;
+	evreader_t* rd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
 	evqueue_t* q;
+	vec_t* ready;
+	evring_t ring;
+	int grow;
+	evlost_t lost;
+	evtimer_t timers[EVPIPE_MAX_TIMERS];
+	int ntimers;
 } evpipe_t;
 
 struct ret_value {
@@ -48,6 +141,16 @@ struct ret_value {
 
 extern int evpipe_init(evpipe_t* evp, size_t qsize);
 extern void evhandler_register(evhandler_t* evh);
-extern struct ret_value evpipe_loop(evpipe_t* evp, int* sig, int strict);
-extern void map_dump(node_t* n);
+extern void evhandler_set_size(uint64_t type, size_t size);
+extern int evpipe_readers_start(evpipe_t* evp, int nreaders, int timeout);
+extern struct ret_value evpipe_loop(evpipe_t* evp, int* sig, int timeout);
+extern void evpipe_stop(evpipe_t* evp);
+extern int evpipe_probe_add(evpipe_t* evp, const char* name);
+extern void evpipe_lost_report(evpipe_t* evp, int final);
+extern int evpipe_timer_add(evpipe_t* evp, uint64_t ms, void (*fn)(void* arg), void* arg);
+extern int evfile_open(const char* path);
+extern void evfile_close(void);
+extern int evfile_decode(const char* path, evhandler_t* (*load)(FILE* fp));
+extern void map_dump(struct smap_t* smap, size_t top);
+extern void map_clear(struct smap_t* smap);
 #endif
@@ -0,0 +1,43 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+/* a tracepoint's format file, parsed once into its fields */
+typedef struct tp_field {
+	char* name;
+	char* type;
+	int offs;
+	int size;
+	int sign;
+} tp_field_t;
+
+typedef struct tp_format {
+	char* name;
+	int nfields;
+	tp_field_t* fields;
+} tp_format_t;
+
+/* a struct member: where it is, how wide, whether it is a signed
+ * integer, and what it is beyond that. type is empty for scalars,
+ * "[]" for arrays, the struct's name for an embedded struct and the
+ * name behind a '*' for a pointer to one. anonymous structs are named
+ * by their BTF id, "#1234". */
+typedef struct struct_field {
+	int offs;
+	int size;
+	int sign;
+	char type[64];
+} struct_field_t;
+
+extern tp_format_t* tp_format_new(const char* name);
+extern void tp_format_field(tp_format_t* fmt, const char* name, const char* type,
+		int offs, int size, int sign);
+
+extern int layout_cache_struct(const char* sname, const char* field, struct_field_t* f);
+extern void layout_cache_struct_add(const char* sname, const char* field, const struct_field_t* f);
+extern tp_format_t* layout_cache_tp(const char* name);
+extern void layout_cache_tp_add(tp_format_t* fmt);
+extern void layout_cache_save(void);
+
+#endif
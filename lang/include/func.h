@@ -1,8 +1,11 @@
 #ifndef FUNC_H
 #define FUNC_H
 
+#include <stdio.h>
+
 #include "ast.h"
 #include "bpflib.h"
+#include "buffer.h"
 
 typedef struct builtin_t {
     const char *name;
@@ -14,5 +17,8 @@ typedef struct builtin_t {
     {.name = _name, .annotate = _annot, .compile = _compile}  \
 
 int global_annot(node_t *call);
+evhandler_t *out_load(FILE *fp);
 int global_compile(node_t *n, ebpf_t *e, type_t type);
+int global_method_annot(node_t *expr);
+int global_method_compile(node_t *expr, ebpf_t *code);
 #endif
\ No newline at end of file
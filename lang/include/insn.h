@@ -8,6 +8,12 @@
 #define _ALIGN sizeof(int64_t)
 #define _ALIGNED(_size) (((_size) + _ALIGN - 1) & ~(_ALIGN - 1))
 
+/* record members narrower than a word are aligned to their width */
+#define _REC_ALIGN(_offs, _size) ({					\
+	size_t __a = ((_size) & (_ALIGN - 1)) ? (size_t)(_size) : _ALIGN;	\
+	((_offs) + __a - 1) & ~(__a - 1);				\
+})
+
 #define BPF_CTX_REG BPF_REG_9
 
 #define INSN(_code, _dst, _src, _off, _imm) \
@@ -49,6 +55,7 @@ typedef enum op_t{
     OP_JA,
     OP_PIPE,
     OP_ACCESS,
+    OP_DOT,
 } op_t;
 
 
@@ -71,6 +78,8 @@ typedef enum op_t{
 #define STXH(_dst, _off, _src)   INSN(BPF_STX | BPF_SIZE(BPF_H) | BPF_MEM, _dst, _src, _off, 0)
 #define STXW(_dst, _off, _src)   INSN(BPF_STX | BPF_SIZE(BPF_W) | BPF_MEM, _dst, _src, _off, 0)
 
+#define XADDDW(_dst, _off, _src) INSN(BPF_STX | BPF_SIZE(BPF_DW) | BPF_XADD, _dst, _src, _off, BPF_ADD)
+
 #define LDXDW(_dst, _off, _src) INSN(BPF_LDX | BPF_SIZE(BPF_DW) | BPF_MEM, _dst, _src, _off, 0)
 #define LDXB(_dst, _off, _src) INSN(BPF_LDX | BPF_SIZE(BPF_B) | BPF_MEM, _dst, _src, _off, 0)
 #define LDXH(_dst, _off, _src)  INSN(BPF_LDX | BPF_SIZE(BPF_H)  | BPF_MEM, _dst, _src, _off, 0)
@@ -52,6 +52,8 @@ enum{
     IR_STORE_ARG,
     IR_STORE_SPILL,
     IR_NOP,
+    IR_PRED,
+    IR_STRUCT_READ,
 };
 
 typedef struct reg_t {
@@ -60,6 +62,7 @@ typedef struct reg_t {
     int def;
     int end;
     bool spill;
+    ssize_t slot;
     char *str;
 } reg_t;
 
@@ -98,6 +101,15 @@ typedef struct ir_t {
     reg_t *bbarg;
 } ir_t;
 
+typedef struct regalloc_stats_t {
+    int vregs;
+    int callee;
+    int caller;
+    int spilled;
+    int loads;
+    int stores;
+} regalloc_stats_t;
+
 typedef struct prog_t {
     char *name;
     node_t *ast;
@@ -105,6 +117,7 @@ typedef struct prog_t {
     vec_t *bbs;
     bool is_end;
     ebpf_t *ctx;
+    regalloc_stats_t stats;
 } prog_t;
 
 extern reg_t *gen_expr(node_t *n);
@@ -113,4 +126,5 @@ extern void dyn_assign(node_t *dst, node_t *src);
 extern int gen_ir(node_t *n);
 extern prog_t *gen_prog(node_t *n);
 extern void compile(prog_t* prog);
+extern int emit_log2(ebpf_t* code, int dst, int src);
 #endif
\ No newline at end of file
@@ -14,6 +14,7 @@
     TYPE(TOKEN_PROFI, "Kprobe")          \
     TYPE(TOKEN_BEGIN, "Begin")           \
     TYPE(TOKEN_END, "End")               \
+    TYPE(TOKEN_INTERVAL, "Interval")     \
     TYPE(TOKEN_SLASH, "Slash")           \
     TYPE(TOKEN_COLON, "Colon")           \
     TYPE(TOKEN_COMMA, "Comma")           \
@@ -39,6 +40,7 @@
     TYPE(TOKEN_LE, "Le")                \
     TYPE(TOKEN_HASH, "Hash")             \
     TYPE(TOKEN_ACCESS, "Access")         \
+    TYPE(TOKEN_DOT, "Dot")               \
     TYPE(TOKEN_PIPE, "Pipe")             \
     TYPE(END_OF_FILE, "End of File")
 
@@ -24,6 +24,7 @@ typedef struct parser_t {
     lexer_t* lexer;
     token_t* this_tok;
     token_t* next_tok;
+    int pred;
 } parser_t;
 
 parser_t* parser_init(lexer_t* l); 
@@ -2,22 +2,33 @@
 #define SYSCALL_H
 
 #include "annot.h"
+#include "cache.h"
 #include <linux/btf.h>
 
-typedef struct profile {
-    int* efds;
-    int num;
-} profile_t;
-
 #define BTF_MAX_NR_TYPES 0x7fffffffU
 #define BTF_MAX_STR_OFFSET 0x7fffffffU
 
 static struct btf_type btf_void;
 
+/* name lookups into BTF, key is a kind for types and the owning
+ * struct's id for members, val is a type id or a member index */
+typedef struct btf_hent {
+    const char* name;
+    __u32 key;
+    __u32 val;
+} btf_hent_t;
+
+typedef struct btf_htab {
+    btf_hent_t* ent;
+    __u32 mask;
+    __u32 len;
+} btf_htab_t;
+
 typedef struct btf_t{
     void* raw_data;
     void* raw_data_swapped;
     __u32 raw_size;
+    size_t mmap_size;
     bool swapped_endian;
     struct btf_header* hdr;
     void* types_data;
@@ -33,6 +44,10 @@ typedef struct btf_t{
     bool owns_base;
     int fd;
     int ptr_sz;
+
+    btf_htab_t names;
+    btf_htab_t members;
+    __u8* members_done;
 } btf_t; 
 
 static inline __u16 btf_vlen(const struct btf_type *t) {
@@ -74,15 +89,24 @@ static inline struct btf_var *btf_var(const struct btf_type *t)
 
 extern long perf_event_open(struct perf_event_attr* hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags); 
 extern int bpf_prog_load(enum bpf_prog_type type, const struct bpf_insn* insns, int insn_cnt); 
-extern int bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries);
+extern int bpf_map_create(enum bpf_map_type type, int key_sz, int val_sz, int entries, uint32_t flags);
 extern int bpf_map_update(int fd, void* key, void* val, int flags);
 extern int bpf_map_lookup(int fd, void* key, void* val);
+extern int bpf_map_next(int fd, void* key, void* next_key);
+extern int bpf_map_lookup_batch(int fd, void* in, void* out, void* keys, void* vals, uint32_t* count);
+extern int bpf_map_delete(int fd, void* key, void* val);
+extern int bpf_map_delete_batch(int fd, void* keys, uint32_t* count);
 extern int bpf_read_field(field_t* field);
 extern int bpf_test_attach(ebpf_t* e);
 extern int bpf_get_probe_id(char* name);
 extern int bpf_get_kprobe_id(char* name);
 extern int bpf_probe_attach(ebpf_t* e, int id);
 extern int bpf_kprobe_attach(ebpf_t* ctx, int id);
+extern int bpf_probe_cpus(const char* list);
+extern int bpf_probe_cpu_ranges(int (*ranges)[2]);
 extern btf_t* btf_load_vmlinux();
+extern btf_t* btf_vmlinux(void);
+extern int arch_reg_offs(int num);
+extern int btf_get_member(const char* struct_name, const char* field_name, struct_field_t* f);
 extern int btf_get_field_off(const char *struct_name, const char *field_name);
 #endif
@@ -10,9 +10,43 @@ typedef enum {
     SYM_VAR,
 } sym_type;
 
+typedef enum {
+    AGG_NONE,
+    AGG_COUNT,
+    AGG_HIST,
+    AGG_LHIST,
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX,
+    AGG_AVG,
+    AGG_STATS,
+} agg_t;
+
+/* per-cpu value of sum, min, max, avg and stats. a cpu that never
+ * saw the key has a zero count and is skipped when combining. */
+typedef struct agg_stats {
+    int64_t count;
+    int64_t sum;
+    int64_t min;
+    int64_t max;
+} agg_stats_t;
+
+/* declared ahead of the probes, e.g. `tids := lru_hash(65536);` */
+typedef struct map_spec {
+    const char *name;
+    enum bpf_map_type type;
+    size_t entries;
+    uint32_t flags;
+} map_spec_t;
+
+#define MAP_DEFAULT_ENTRIES 1024
+#define MAP_ARRAY_MAX_KEY 1024
+
 typedef struct smap_t{
     int id;
     enum bpf_map_type type;
+    agg_t agg;
+    node_t *method;
     size_t ksize, vsize, nelem;
     type_t ktype;
     ssize_t kaddr;
@@ -35,14 +69,23 @@ typedef struct symtable_t {
     size_t cap, len;
     sym_t *table;
     struct symtable_t *out;
+
+    map_spec_t *specs;
+    size_t nspecs;
 } symtable_t;
 
+extern int map_percpu;
+
 extern symtable_t *symtable_new();
 extern symtable_t *symtable_create(symtable_t *out);
 extern sym_t *symtable_get(symtable_t *st, const char *name);
 extern int sym_transfer(sym_t *st, node_t *n);
 extern void var_dec(symtable_t *st, node_t *var, node_t* expr);
+extern void map_spec_dec(symtable_t *st, node_t *dec);
+extern bool map_is_percpu(enum bpf_map_type type);
+extern bool map_is_array(enum bpf_map_type type);
 extern void map_dec(symtable_t *st, node_t *map, node_t* expr);
+extern void map_agg_dec(symtable_t *st, node_t *map, node_t *method, agg_t agg);
 extern sym_t *symtable_add(symtable_t *st, char *name);
 extern int sym_ref(symtable_t* st, node_t* node);
 extern int symtable_ref(symtable_t *st, node_t *n);
@@ -103,7 +103,16 @@ extern char *vstr(char *str);
 extern char *str_escape(char *str);
 extern FILE *fopenf(const char *mode, const char *fmt, ...);
 extern char* read_file(char* name);
+extern int cpulist_parse(const char *list, bool *mask, int n);
+extern int cpus_possible(void);
+extern void obuf_flush(void);
+extern char *obuf_reserve(size_t len);
+extern void obuf_commit(size_t len);
+extern void obuf_write(const void *data, size_t len);
+extern void obuf_printf(const char *fmt, ...) __printf(1, 2);
 extern void output_hist(FILE* fp, int log2, int64_t count, int64_t max);
+extern void output_lhist(FILE* fp, int64_t bucket, int64_t min, int64_t max,
+			 int64_t step, int64_t count, int64_t cmax);
 extern void *ut_add_mem(void **data, size_t *cap_cnt, size_t elem_sz,
 		     size_t cur_cnt, size_t max_cnt, size_t add_cnt);
 #endif
\ No newline at end of file
@@ -10,7 +10,6 @@ static prog_t *prog;
 static bb_t *curbb;
 static int nreg = 1;
 static int nlabel = 1;
-static int regnum = 3;
 
 static bb_t *bb_new() {
     bb_t *bb = calloc(1, sizeof(*bb));
@@ -87,9 +86,10 @@ static ir_t* map_look(node_t* map) {
     return ir;
 }
 
-static ir_t* map_count(node_t* map) {
+static ir_t* map_method(node_t* expr, reg_t* arg) {
     ir_t* ir = ir_new(IR_MAP_METHOD);
-    ir->value = map;
+    ir->value = expr;
+    ir->r2 = arg;
     return ir;
 }
 
@@ -168,7 +168,7 @@ ir_t *store(node_t *dst, reg_t *src) {
     ir = ir_new(IR_STORE);
     
     ir->value = dst;
-    ir->r0 = src;
+    ir->r2 = src;
 
     return ir;
 }
@@ -179,7 +179,7 @@ ir_t* arg_reg_to_stack(node_t* arg, reg_t* reg) {
     ir = ir_new(IR_ARG);
     
     ir->value = arg;
-    ir->r0 = reg;
+    ir->r2 = reg;
     ir->addr = arg->annot.addr;
     ir->size = arg->annot.size;
 
@@ -246,6 +246,7 @@ reg_t* gen_binop(node_t *n) {
     case OP_EQ:
         return binop(IR_EQ, n);
     case OP_ACCESS:
+    case OP_DOT:
         return arg_read(n);
     default:
         break;
@@ -381,12 +382,17 @@ void dyn_args(node_t* dst) {
 }
 
 void gen_map_method(node_t* expr) {
-    node_t* map;
+    node_t* map, *arg;
+    reg_t* r = NULL;
 
     map = expr->expr.left;
+    arg = expr->expr.right->call.args;
 
     dyn_args(map->map.args);
-    map_count(map);
+    if (arg)
+        r = gen_expr(arg);
+
+    map_method(expr, r);
 }
 
 void gen_dec(node_t *dec) {
@@ -465,8 +471,16 @@ int gen_ir(node_t *n) {
 
     curbb = bb_new();
     bb_t *bb = bb_new();
+
+    /* the entry block is compiled ahead of the probe's data */
+    if (n->probe.pred)
+        emit(IR_PRED, NULL, NULL, gen_expr(n->probe.pred));
+
     jmp(bb);
     curbb = bb;
+
+    /* struct fields are read once, at the top of the body */
+    ir_new(IR_STRUCT_READ);
     
     _foreach(head, n->probe.stmts) {
         gen_stmt(head);
@@ -477,7 +491,7 @@ int gen_ir(node_t *n) {
 }
 
 prog_t *prog_new(node_t *n) {
-    prog_t *p = vmalloc(sizeof(*p));
+    prog_t *p = vcalloc(1, sizeof(*p));
     p->ast = n;
     p->data = vec_new();
     p->bbs = vec_new();
@@ -577,10 +591,42 @@ static void ir_trans(bb_t *bb) {
     bb->ir = v;
 }
 
-static vec_t *ir_collect(prog_t *prog) {
+/* helpers clobber r0-r5, so does everything that may call one. only
+ * the instructions below leave them alone. */
+static bool ir_clobbers(ir_t* ir) {
+    switch (ir->op) {
+    case IR_IMM:
+    case IR_MOV:
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_GT:
+    case IR_GE:
+    case IR_LT:
+    case IR_LE:
+    case IR_EQ:
+    case IR_STORE:
+    case IR_ARG:
+    case IR_BR:
+    case IR_PRED:
+    case IR_JMP:
+    case IR_IF_THEN:
+    case IR_IF_END:
+    case IR_ELSE_THEN:
+    case IR_ELSE_END:
+    case IR_RETURN:
+    case IR_NOP:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static vec_t *ir_collect(prog_t *prog, vec_t* calls) {
     vec_t *vec = vec_new();
     int ic = 1;
-    int i, j, k;
+    int i, j;
     bb_t* bb;
     ir_t* ir;
 
@@ -599,10 +645,10 @@ static vec_t *ir_collect(prog_t *prog) {
             ir_set_end(ir->r2, ic);
             ir_set_end(ir->bbarg, ic);
 
-            if (ir->op == IR_CALL) {
-                for (k = 0; k < ir->nargs; k++)
-                    ir_set_end(ir->args[k], ic);
-            }
+            /* the probe's data is put on the stack right after the
+             * entry block, which calls helpers too */
+            if (ir_clobbers(ir) || (i == 0 && j == bb->ir->len - 1))
+                vec_push(calls, (void*)(long)ic);
         }
 
         for (j = 0; j < bb->out_regs->len; j++) {
@@ -614,61 +660,187 @@ static vec_t *ir_collect(prog_t *prog) {
     return vec;
 }
 
-static int ir_spill(reg_t **used) {
-    int i, k = 0;
-    for (i = 1; i < regnum; i++) {
-        if (used[k]->end < used[i]->end) {
-            k = i;
-        }
+/* r6-r8 survive helper calls, r1-r3 only hold values that do not live
+ * across one. r4 and r5 are left for reloading spilled values. */
+static const int callee_regs[] = { BPF_REG_6, BPF_REG_7, BPF_REG_8 };
+static const int caller_regs[] = { BPF_REG_1, BPF_REG_2, BPF_REG_3 };
+
+#define SPILL_REG0 BPF_REG_4
+#define SPILL_REG2 BPF_REG_5
+#define NREGS (BPF_REG_10 + 1)
+
+static bool ir_crosses(reg_t* reg, vec_t* calls) {
+    long ic;
+    int i;
+
+    for (i = 0; i < calls->len; i++) {
+        ic = (long)calls->data[i];
+        if (reg->def < ic && ic < reg->end)
+            return true;
     }
-    return k;
+
+    return false;
 }
 
-void ir_scan(vec_t *regs) {
-    int i, j, k;
-    bool found;
-    reg_t **used = calloc(regnum, sizeof(reg_t *));
+static bool is_callee_reg(int rn) {
+    return rn >= BPF_REG_6 && rn <= BPF_REG_8;
+}
+
+/* classic linear scan: intervals in order of definition, the one
+ * ending last is spilled when no register is free */
+void ir_scan(vec_t *regs, vec_t* calls, regalloc_stats_t* stats) {
+    reg_t* owner[NREGS] = {};
+    reg_t* reg, *victim;
+    bool cross;
+    int i, j, rn;
 
     for (i = 0; i < regs->len; i++) {
-        reg_t *reg = regs->data[i];
-        found = false;
+        reg = regs->data[i];
+        stats->vregs++;
+
+        /* defined but never read, it only needs a register for the
+         * instruction that writes it */
+        if (reg->end <= reg->def) {
+            reg->rn = SPILL_REG0;
+            continue;
+        }
+
+        for (rn = 0; rn < NREGS; rn++) {
+            if (owner[rn] && owner[rn]->end <= reg->def)
+                owner[rn] = NULL;
+        }
+
+        cross = ir_crosses(reg, calls);
+        reg->rn = -1;
+
+        for (j = 0; !cross && j < sizeof(caller_regs) / sizeof(*caller_regs) && reg->rn < 0; j++) {
+            if (!owner[caller_regs[j]])
+                reg->rn = caller_regs[j];
+        }
+
+        for (j = 0; j < sizeof(callee_regs) / sizeof(*callee_regs) && reg->rn < 0; j++) {
+            if (!owner[callee_regs[j]])
+                reg->rn = callee_regs[j];
+        }
+
+        if (reg->rn < 0) {
+            victim = NULL;
+            for (rn = 0; rn < NREGS; rn++) {
+                if (!owner[rn] || (cross && !is_callee_reg(rn)))
+                    continue;
+                if (!victim || owner[rn]->end > victim->end)
+                    victim = owner[rn];
+            }
 
-        for (j = 0; j < regnum - 1; j++) {
-            if (used[j] && reg->def < used[j]->end) {
+            if (victim && victim->end > reg->end) {
+                reg->rn = victim->rn;
+                victim->spill = true;
+                owner[victim->rn] = NULL;
+            } else {
+                reg->spill = true;
+                stats->spilled++;
                 continue;
             }
-            reg->rn = j;
-            used[j] = reg;
-            found = true;
-            break;
+
+            stats->spilled++;
         }
 
-        if (found)
+        owner[reg->rn] = reg;
+    }
+
+    for (i = 0; i < regs->len; i++) {
+        reg = regs->data[i];
+        if (reg->spill || reg->end <= reg->def)
             continue;
 
-        used[regnum - 1] = reg;
+        if (is_callee_reg(reg->rn))
+            stats->callee++;
+        else
+            stats->caller++;
+    }
+}
+
+static reg_t* spill_reg(int rn) {
+    reg_t* tmp = reg_new();
+
+    tmp->rn = rn;
+    return tmp;
+}
+
+static ir_t* spill_ir(int op, reg_t* r0, reg_t* r2) {
+    ir_t* ir = calloc(1, sizeof(*ir));
+
+    ir->op = op;
+    ir->r0 = r0;
+    ir->r2 = r2;
+    return ir;
+}
+
+/* spilled values live in a stack slot, they are loaded into r4 or r5
+ * right before an instruction reads them and stored right after one
+ * writes them */
+static void ir_spill_code(bb_t* bb, regalloc_stats_t* stats) {
+    vec_t* v = vec_new();
+    reg_t* tmp, *spilled = NULL;
+    ir_t* ir;
+    int i;
+
+    for (i = 0; i < bb->ir->len; i++) {
+        ir = bb->ir->data[i];
 
-        k = ir_spill(used);
-        reg->rn = k;
-        used[k]->rn = regnum - 1;
-        used[k]->spill = true;
-        used[k] = reg;
+        if (ir->r2 && ir->r2->spill) {
+            tmp = spill_reg(SPILL_REG2);
+            vec_push(v, spill_ir(IR_LOAD_SPILL, tmp, ir->r2));
+            ir->r2 = tmp;
+            stats->loads++;
+        }
+
+        spilled = NULL;
+        if (ir->r0 && ir->r0->spill) {
+            spilled = ir->r0;
+            tmp = spill_reg(SPILL_REG0);
+
+            if (ir->r1 == ir->r0) {
+                vec_push(v, spill_ir(IR_LOAD_SPILL, tmp, spilled));
+                ir->r1 = tmp;
+                stats->loads++;
+            }
+            ir->r0 = tmp;
+        }
+
+        vec_push(v, ir);
+
+        if (spilled) {
+            vec_push(v, spill_ir(IR_STORE_SPILL, spilled, ir->r0));
+            stats->stores++;
+        }
     }
+
+    bb->ir = v;
 }
 
 void ir_regs_alloc(prog_t *prog) {
-    int i;
+    vec_t *regs, *calls;
     bb_t *bb;
-    vec_t *regs;
-    node_t *var;
+    int i;
 
     for (i = 0; i < prog->bbs->len; i++) {
         bb = prog->bbs->data[i];
         ir_trans(bb);
     }
 
-    regs = ir_collect(prog);
-    ir_scan(regs);
+    calls = vec_new();
+    regs = ir_collect(prog, calls);
+    ir_scan(regs, calls, &prog->stats);
+
+    for (i = 0; i < prog->bbs->len; i++) {
+        bb = prog->bbs->data[i];
+        ir_spill_code(bb, &prog->stats);
+    }
+
+    _pr_debug("%s: %d values, %d in r6-r8, %d in r1-r3, %d spilled (%d loads, %d stores)\n",
+        prog->ast->probe.name, prog->stats.vregs, prog->stats.callee, prog->stats.caller,
+        prog->stats.spilled, prog->stats.loads, prog->stats.stores);
 }
 
 prog_t *gen_prog(node_t *n) {
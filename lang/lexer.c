@@ -28,6 +28,9 @@ token_type get_type(char *str) {
     if (vstreq(str, "END"))
         return TOKEN_END;
 
+    if (!strcmp(str, "interval"))
+        return TOKEN_INTERVAL;
+
     if (!strcmp(str, "if"))
         return TOKEN_IF;
 
@@ -165,6 +168,12 @@ token_t* lexer_next_token(lexer_t *lexer) {
         read_char(lexer);
         return token;
 
+    case '.':
+        token->type = TOKEN_DOT;
+        token->literal = strdup(".");
+        read_char(lexer);
+        return token;
+
     case '+':
         token->type = TOKEN_PLUS;
         token->literal = strdup("+");
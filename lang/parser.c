@@ -49,6 +49,7 @@ parser_t *parser_init(lexer_t *lexer) {
     parser->lexer = lexer;
     parser->this_tok = NULL;
     parser->next_tok = NULL;
+    parser->pred = 0;
 
     advance(parser);
     advance(parser);
@@ -105,7 +106,8 @@ get_token_seq(token_type type) {
         return LESSGREATERA;
     
     case TOKEN_ACCESS:
-        return SUM;
+    case TOKEN_DOT:
+        return INDEX;
     default:
         return LOWEST;
     }
@@ -148,6 +150,9 @@ static int get_op(token_type type) {
     
     case TOKEN_ACCESS:
         return OP_ACCESS;
+
+    case TOKEN_DOT:
+        return OP_DOT;
         
     default:
         return OP_ILLEGAL;
@@ -343,10 +348,15 @@ node_t *parse_expr(parser_t *p, seq_t s) {
     }
     
     while (!expect(p, TOKEN_SEMICOLON) && s < get_token_seq(p->next_tok->type)) {
+        /* a predicate is closed by a slash, not divided by it */
+        if (p->pred && expect(p, TOKEN_SLASH))
+            break;
+
         switch (p->next_tok->type) {
         case TOKEN_SLASH:
         case TOKEN_EQ:
         case TOKEN_ACCESS:
+        case TOKEN_DOT:
         case TOKEN_GE:
         case TOKEN_GT:
         case TOKEN_LE:
@@ -408,7 +418,7 @@ node_t *parse_block_stmts(parser_t *p) {
 node_t* parse_probe(parser_t* parser, char* event) {
     char* name;
     int flag = 0;
-    node_t* stmts, *pred;
+    node_t* stmts, *pred = NULL, *probe;
 
     if (!expect_next_token(parser, TOKEN_IDENT)) {
         return NULL;
@@ -428,21 +438,41 @@ node_t* parse_probe(parser_t* parser, char* event) {
 
     if (parser->this_tok->type == TOKEN_SLASH) {
         advance(parser);
+        parser->pred = 1;
         pred = parse_expr(parser, LOWEST);
+        parser->pred = 0;
         advance(parser);
         advance(parser);
     }
 
     stmts = parse_block_stmts(parser);
+    probe = flag ? node_probe_new(name, stmts) : node_kprobe_new(name, stmts);
+    probe->probe.pred = pred;
 
-    if (!flag) {
-        return node_kprobe_new(name, stmts);
-    }
-
-    return node_probe_new(name, stmts);
+    return probe;
 }
 
 
+/* interval 5s { ... }, the period takes an s or ms suffix */
+node_t* parse_interval(parser_t* parser) {
+    char* unit;
+    size_t ms;
+
+    advance(parser);
+    ms = strtoul(parser->this_tok->literal, &unit, 10);
+
+    if (!strcmp(unit, "s"))
+        ms *= 1000;
+    else if (strcmp(unit, "ms"))
+        verror("interval needs a period like 5s or 500ms, got %s", parser->this_tok->literal);
+
+    if (!ms)
+        verror("interval period must not be zero");
+
+    advance(parser);
+    return node_interval_new(ms, parse_block_stmts(parser));
+}
+
 node_t* parse_script(parser_t* parser, char* event) {
     char* name;
     node_t* stmts;
@@ -465,6 +495,23 @@ node_t* parse_script(parser_t* parser, char* event) {
         return stmts;
     }
 
+    if (current(parser, TOKEN_INTERVAL)) {
+        stmts = parse_interval(parser);
+        advance(parser);
+        return stmts;
+    }
+
+    /* map declarations, name := type(entries, flag...); */
+    if (current(parser, TOKEN_IDENT)) {
+        stmts = parse_expr(parser, LOWEST);
+        if (!stmts || stmts->type != NODE_DEC)
+            verror("expected a probe or a map declaration");
+
+        advance(parser);
+        advance(parser);
+        return stmts;
+    }
+
     return NULL;
 }
 
@@ -13,11 +13,15 @@
 #include <sys/utsname.h>
 #include <linux/version.h>
 #include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/resource.h>
 #include <sys/syscall.h>
 
 #include "annot.h" 
 #include "probe.h"
+#include "cache.h"
 #include "ut.h"
 
 #define LOG_BUF_SIZE 1 << 20
@@ -54,12 +58,13 @@ int bpf_prog_load(enum bpf_prog_type type, const struct bpf_insn* insns, int ins
 }
 
 
-int bpf_map_create(enum bpf_map_type type, int ksize, int size, int entries) {
+int bpf_map_create(enum bpf_map_type type, int ksize, int size, int entries, uint32_t flags) {
     union bpf_attr attr = {
        .map_type = type,
        .key_size = ksize,
        .value_size = size,
        .max_entries = entries,
+       .map_flags = flags,
     };
 
     return _bpf(BPF_MAP_CREATE, &attr);
@@ -77,118 +82,133 @@ int bpf_test_attach(ebpf_t* ctx) {
 }
 
 
-int bpf_kprobe_attach(ebpf_t* ctx, int id) {
-    struct perf_event_attr attr = {};
-    
-    int ed, bd;
+static int ncpus_conf;
+static bool* cpus_allowed;
 
-    attr.type = PERF_TYPE_TRACEPOINT;
-    attr.sample_type = PERF_SAMPLE_RAW;
-    attr.sample_period = 1;
-    attr.wakeup_events = 1;
-    attr.config = id;  
-    
-    bd = bpf_prog_load(BPF_PROG_TYPE_KPROBE, ctx->prog, ctx->ip - ctx->prog);
-    
-    if (bd < 0) {
-        perror("bpf");
-        fprintf(stderr, "bpf verifier:\n%s\n", bpf_log_buf);
-        return 1;
-    }
-    
-    ed = perf_event_open(&attr, -1, 0, -1, 0);
+static int ncpus_get(void) {
+    if (!ncpus_conf)
+        ncpus_conf = sysconf(_SC_NPROCESSORS_CONF);
 
-    if (ed < 0){
-        perror("perf_event_open");
-        return 1;
-    }
-    
-    if (ioctl(ed, PERF_EVENT_IOC_ENABLE, 0)) {
-        perror("perf enable");
-        return 1;
+    return ncpus_conf;
+}
+
+static void cpus_online(bool* mask, int n) {
+    char line[0x400];
+    FILE* fp;
+    int cpu;
+
+    fp = fopen("/sys/devices/system/cpu/online", "r");
+    if (fp && fgets(line, sizeof(line), fp) && !cpulist_parse(line, mask, n)) {
+        fclose(fp);
+        return;
     }
 
-    if (ioctl(ed, PERF_EVENT_IOC_SET_BPF, bd)) {
-        perror("perf attach");
-        return 1;
-    } 
+    if (fp)
+        fclose(fp);
 
-    return 0;
+    for (cpu = 0; cpu < n; cpu++)
+        mask[cpu] = cpu < sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+int bpf_probe_cpus(const char* list) {
+    int cpu, n = ncpus_get();
 
-int bpf_probe_attach(ebpf_t* ctx, int id) {
+    cpus_allowed = vcalloc(n, sizeof(*cpus_allowed));
+    if (cpulist_parse(list, cpus_allowed, n))
+        return -EINVAL;
+
+    /* a list of cpus that do not exist would filter out everything */
+    for (cpu = 0; cpu < n; cpu++) {
+        if (cpus_allowed[cpu])
+            return 0;
+    }
+
+    return -EINVAL;
+}
+
+/* the -C list as ranges of cpus, for the check compiled into every
+ * tracepoint and kprobe program, none when every cpu is wanted. the
+ * count is returned in any case, ranges are only filled in when given. */
+int bpf_probe_cpu_ranges(int (*ranges)[2]) {
+    int cpu, last = -2, n = 0, num = ncpus_get();
+
+    if (!cpus_allowed)
+        return 0;
+
+    for (cpu = 0; cpu < num; cpu++) {
+        if (!cpus_allowed[cpu])
+            continue;
+
+        if (cpu != last + 1) {
+            if (ranges)
+                ranges[n][0] = cpu;
+            n++;
+        }
+
+        if (ranges)
+            ranges[n - 1][1] = cpu;
+        last = cpu;
+    }
+
+    return n;
+}
+
+/* a tracepoint or kprobe program runs on whatever cpu hits the event,
+ * the perf event only hooks it up, and every event of a tracepoint
+ * shares one program array, so a second event with the same program
+ * is refused. one event on the first online cpu is enough, perf does
+ * not take pid -1 together with cpu -1. */
+static int bpf_attach(enum bpf_prog_type type, ebpf_t* ctx, int id) {
     struct perf_event_attr attr = {};
-    
-    int ed, bd;
+    int bd, ed, cpu, n;
+    bool* online;
 
     attr.type = PERF_TYPE_TRACEPOINT;
     attr.sample_type = PERF_SAMPLE_RAW;
     attr.sample_period = 1;
-    attr.wakeup_events = 1;
-    attr.config = id;  
-    
-    bd = bpf_prog_load(BPF_PROG_TYPE_TRACEPOINT, ctx->prog, ctx->ip - ctx->prog);
-    
+    attr.config = id;
+
+    bd = bpf_prog_load(type, ctx->prog, ctx->ip - ctx->prog);
+
     if (bd < 0) {
         perror("bpf");
         fprintf(stderr, "bpf verifier:\n%s\n", bpf_log_buf);
         return 1;
     }
-    
-    ed = perf_event_open(&attr, -1, 0, -1, 0);
 
-    if (ed < 0){
+    n = ncpus_get();
+    online = vcalloc(n, sizeof(*online));
+    cpus_online(online, n);
+    for (cpu = 0; cpu < n - 1 && !online[cpu]; cpu++);
+    free(online);
+
+    ed = perf_event_open(&attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+    if (ed < 0) {
         perror("perf_event_open");
-        return 1;
-    }
-    
-    if (ioctl(ed, PERF_EVENT_IOC_ENABLE, 0)) {
-        perror("perf enable");
+        close(bd);
         return 1;
     }
 
-    if (ioctl(ed, PERF_EVENT_IOC_SET_BPF, bd)) {
+    if (ioctl(ed, PERF_EVENT_IOC_SET_BPF, bd) || ioctl(ed, PERF_EVENT_IOC_ENABLE, 0)) {
         perror("perf attach");
+        close(ed);
+        close(bd);
         return 1;
-    } 
-
-    return 0;
-}
-
-static int profile_perf_event_open(profile_t* profile, int cpu, int freq) {
-    struct perf_event_attr attr = {};
-    int err = 0, i = profile->num, bd;
-
-    attr.type = PERF_TYPE_SOFTWARE;
-    attr.config = PERF_COUNT_SW_CPU_CLOCK;
-    attr.freq = 1;
-    attr.sample_freq = freq;
-
-    profile->efds[i] = perf_event_open(&attr, -1, cpu, -1, 0);
-
-    if (profile->efds[i] < 0) {
-        return -errno;
-    }
-
-    if (ioctl(profile->efds[i], PERF_EVENT_IOC_ENABLE, 0)) {
-        close(profile->efds[i]);
-        return -errno;
     }
 
-    profile->num++;
     return 0;
 }
 
-void profile_attach(ebpf_t* code) {
-    int ncpus;
-    profile_t* profile;
+int bpf_kprobe_attach(ebpf_t* ctx, int id) {
+    return bpf_attach(BPF_PROG_TYPE_KPROBE, ctx, id);
+}
 
-    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-    profile = vcalloc(1, sizeof(*profile));
+int bpf_probe_attach(ebpf_t* ctx, int id) {
+    return bpf_attach(BPF_PROG_TYPE_TRACEPOINT, ctx, id);
 }
 
 
+
 type_t get_filed_type(char* name, unsigned long size, unsigned long sign) {
     int s = 1;
 
@@ -209,22 +229,48 @@ type_t get_filed_type(char* name, unsigned long size, unsigned long sign) {
     }
 }
 
-int bpf_read_field(field_t* field) {
-    FILE* fmt;
-    unsigned long offs, size, sign, len = 0;
-    char line[0x80];
+static btf_hent_t* btf_htab_get(btf_htab_t* ht, __u32 key, const char* name);
+static void btf_htab_add(btf_htab_t* ht, __u32 key, const char* name, __u32 val);
 
-    fmt = fopenf("r", "/sys/kernel/debug/tracing/events/%s/format", field->name); 
+/* tracefs has its own mount on newer systems and lives under debugfs
+ * on older ones, the first with events in it is used from then on */
+static const char* tracefs_dir(void) {
+    static const char* dirs[] = { "/sys/kernel/tracing", "/sys/kernel/debug/tracing", NULL };
+    static const char* dir;
+    char path[64];
+    int i;
 
-    if (!fmt) {
-        fclose(fmt);
-        error("can't open the file");
-        return;
+    if (dir)
+        return dir;
+
+    for (i = 0; dirs[i]; i++) {
+        snprintf(path, sizeof(path), "%s/events", dirs[i]);
+        if (!access(path, F_OK))
+            return dir = dirs[i];
     }
-    
+
+    verror("tracefs is not mounted");
+    return NULL;
+}
+
+/* the whole format file is parsed the first time a tracepoint is used,
+ * or taken from the layout cache */
+static tp_format_t* tp_format_get(const char* name) {
+    tp_format_t* tp;
+    FILE* fmt;
+    char line[0x80];
     char* save, *offs_s, *size_s, *sign_s;
-    char* type_s, *str, *tname;
+    char* type_s, *tname;
+
+    tp = layout_cache_tp(name);
+    if (tp)
+        return tp;
 
+    fmt = fopenf("r", "%s/events/%s/format", tracefs_dir(), name);
+    if (!fmt)
+        verror("can't open the format of %s", name);
+
+    tp = tp_format_new(name);
 
     while (fgets(line, sizeof(line), fmt)) {
         if (!strstr(line, "field:"))
@@ -237,31 +283,73 @@ int bpf_read_field(field_t* field) {
 
         if (!(type_s && offs_s && size_s && sign_s)) {
             _e("read type_s, off_s error");
+            continue;
         }
 
-        type_s += sizeof("field:");
+        type_s = strstr(type_s, "field:") + sizeof("field:") - 1;
         offs_s += sizeof("offset:");
         size_s += sizeof("size:");
         sign_s += sizeof("signed:");
 
-        offs = strtol(offs_s, NULL, 0);
-        size = strtoul(size_s, NULL, 0);
-        sign = strtoul(sign_s, NULL, 0);
-
-        if (!type_s) {
-            _e("type not found");
-        }
-
         tname = rindex(type_s, ' ');
+        if (!tname)
+            continue;
         *tname++ = '\0';
 
-        if (!strcmp(tname, field->field)) {
-            field->offs = offs;
-            field->type = get_filed_type(type_s, size, sign);
-            return 0;
-        }
+        tp_format_field(tp, tname, type_s, strtol(offs_s, NULL, 0),
+            strtoul(size_s, NULL, 0), strtoul(sign_s, NULL, 0));
+    }
+
+    fclose(fmt);
+    layout_cache_tp_add(tp);
+    return tp;
+}
+
+/* tracepoints are indexed under key 0 by name, and the fields of the
+ * n-th one under key n + 1, so every access after the first is a probe */
+static btf_htab_t tp_index;
+static tp_format_t** tp_formats;
+static __u32 tp_nformats;
+
+static tp_format_t* tp_format_find(const char* name, __u32* idx) {
+    btf_hent_t* e;
+    tp_format_t* tp;
+    int i;
+
+    e = btf_htab_get(&tp_index, 0, name);
+    if (e) {
+        *idx = e->val;
+        return tp_formats[e->val];
     }
 
+    tp = tp_format_get(name);
+
+    *idx = tp_nformats++;
+    tp_formats = vrealloc(tp_formats, tp_nformats * sizeof(*tp_formats));
+    tp_formats[*idx] = tp;
+
+    btf_htab_add(&tp_index, 0, tp->name, *idx);
+    for (i = 0; i < tp->nfields; i++)
+        btf_htab_add(&tp_index, *idx + 1, tp->fields[i].name, i);
+
+    return tp;
+}
+
+int bpf_read_field(field_t* field) {
+    tp_format_t* tp;
+    tp_field_t* f;
+    btf_hent_t* e;
+    __u32 idx;
+
+    tp = tp_format_find(field->name, &idx);
+
+    e = btf_htab_get(&tp_index, idx + 1, field->field);
+    if (!e)
+        return -ENOENT;
+
+    f = &tp->fields[e->val];
+    field->offs = f->offs;
+    field->type = get_filed_type(f->type, f->size, f->sign);
     return 0;
 }
 
@@ -319,40 +407,41 @@ int arch_reg_arg(int num) {
 	return -ENOSYS;
 }
 
+/* where a kprobe's argument sits in pt_regs */
+int arch_reg_offs(int num) {
+    int reg = arch_reg_arg(num);
+
+    if (reg < 0)
+        verror("kprobes have no argument %d", num);
+
+    return btf_get_field_off("pt_regs", reg_names[reg]);
+}
+
 int bpf_get_probe_id(char* name) {
-    char* buffer;
     FILE* fp;
     int number;
 
-    buffer = vmalloc(256);
-    sprintf(buffer, "/sys/kernel/debug/tracing/events/%s/id", name);
-    
-    fp = fopen(buffer, "r");
-
-    if (fp == NULL) {
-        verror("Error opening file");
-        return 1;
-    }
+    fp = fopenf("r", "%s/events/%s/id", tracefs_dir(), name);
+    if (!fp)
+        verror("can't find tracepoint %s", name);
 
     if (fscanf(fp, "%d", &number) != 1) {
-        fprintf(stderr, "Error reading number from file\n");
         fclose(fp);
-        return 1;
+        verror("can't read the id of tracepoint %s", name);
     }
-    
-    free(buffer);
+
+    fclose(fp);
     return number;
 }
 
 int bpf_get_kprobe_id(char* func) {
     FILE* fp;
-    char str[128];
+    char str[256];
 
-	sprintf(str, "echo 'p %s' >/sys/kernel/debug/tracing/kprobe_events", func);
+	snprintf(str, sizeof(str), "echo 'p %s' >%s/kprobe_events", func, tracefs_dir());
 	system(str);
 
-    sprintf(str, "/sys/kernel/debug/tracing/events/kprobes/p_%s_0/id", func);
-    fp = fopen(str, "r");
+    fp = fopenf("r", "%s/events/kprobes/p_%s_0/id", tracefs_dir(), func);
     if (!fp)
         return -1;
     
@@ -385,10 +474,47 @@ int bpf_map_next(int fd, void* key, void* next_key) {
     return bpf_map_op(BPF_MAP_GET_NEXT_KEY, fd, key, next_key, 0);
 }
 
+/* in == NULL starts from the beginning, the position to continue from
+ * is left in out. *count is the room on the way in and the number of
+ * entries copied on the way out, also when the map is exhausted. */
+int bpf_map_lookup_batch(int fd, void* in, void* out, void* keys, void* vals, uint32_t* count) {
+	union bpf_attr attr = {
+		.batch = {
+			.in_batch = ptr_to_u64(in),
+			.out_batch = ptr_to_u64(out),
+			.keys = ptr_to_u64(keys),
+			.values = ptr_to_u64(vals),
+			.count = *count,
+			.map_fd = fd,
+		},
+	};
+	int err;
+
+	err = _bpf(BPF_MAP_LOOKUP_BATCH, &attr);
+	*count = attr.batch.count;
+	return err;
+}
+
 int bpf_map_delete(int fd, void* key, void* val) {
 	return bpf_map_op(BPF_MAP_DELETE_ELEM, fd, key, val, 0);
 }
 
+/* stops at the first key that is gone, *count is how many went before it */
+int bpf_map_delete_batch(int fd, void* keys, uint32_t* count) {
+	union bpf_attr attr = {
+		.batch = {
+			.keys = ptr_to_u64(keys),
+			.count = *count,
+			.map_fd = fd,
+		},
+	};
+	int err;
+
+	err = _bpf(BPF_MAP_DELETE_BATCH, &attr);
+	*count = attr.batch.count;
+	return err;
+}
+
 int bpf_map_close(int fd){
     close(fd);
 }
@@ -501,11 +627,16 @@ static int btf_type_size(const struct btf_type *t) {
 	case BTF_KIND_TYPEDEF:
 	case BTF_KIND_FUNC:
 	case BTF_KIND_FLOAT:
+	case BTF_KIND_TYPE_TAG:
 		return base_size;
 	case BTF_KIND_INT:
 		return base_size + sizeof(__u32);
 	case BTF_KIND_ENUM:
 		return base_size + vlen * sizeof(struct btf_enum);
+	case BTF_KIND_ENUM64:
+		return base_size + vlen * sizeof(struct btf_enum64);
+	case BTF_KIND_DECL_TAG:
+		return base_size + sizeof(struct btf_decl_tag);
 	case BTF_KIND_ARRAY:
 		return base_size + sizeof(struct btf_array);
 	case BTF_KIND_STRUCT:
@@ -543,10 +674,22 @@ static int btf_bswap_type_rest(struct btf_type *t)
 	case BTF_KIND_TYPEDEF:
 	case BTF_KIND_FUNC:
 	case BTF_KIND_FLOAT:
+	case BTF_KIND_TYPE_TAG:
 		return 0;
 	case BTF_KIND_INT:
 		*(__u32 *)(t + 1) = bswap_32(*(__u32 *)(t + 1));
 		return 0;
+	case BTF_KIND_DECL_TAG:
+		((struct btf_decl_tag *)(t + 1))->component_idx =
+			bswap_32(((struct btf_decl_tag *)(t + 1))->component_idx);
+		return 0;
+	case BTF_KIND_ENUM64:
+		for (i = 0, e64 = (struct btf_enum64 *)(t + 1); i < vlen; i++, e64++) {
+			e64->name_off = bswap_32(e64->name_off);
+			e64->val_lo32 = bswap_32(e64->val_lo32);
+			e64->val_hi32 = bswap_32(e64->val_hi32);
+		}
+		return 0;
 	case BTF_KIND_ENUM:
 		for (i = 0, e = btf_enum(t); i < vlen; i++, e++) {
 			e->name_off = bswap_32(e->name_off);
@@ -663,9 +806,15 @@ void btf_free(btf_t* btf) {
         free(btf->types_data);
     }
 
-    free(btf->raw_data);
+    if (btf->mmap_size)
+        munmap(btf->raw_data, btf->mmap_size);
+    else
+        free(btf->raw_data);
     free(btf->raw_data_swapped);
     free(btf->type_offs);
+    free(btf->names.ent);
+    free(btf->members.ent);
+    free(btf->members_done);
 
     if (btf->owns_base)
         btf_free(btf->base_btf);
@@ -781,6 +930,64 @@ err_out:
     return err ? ERR_PTR(err) : btf;
 }
 
+/* native BTF is only ever read, so it can be used straight from a
+ * private read-only mapping of the file instead of being copied. */
+static btf_t* btf_parse_mmap(const char* path) {
+    struct stat st;
+    btf_t* btf;
+    void* data;
+    int fd, err;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return ERR_PTR(-errno);
+
+    if (fstat(fd, &st) || st.st_size < sizeof(struct btf_header)) {
+        close(fd);
+        return ERR_PTR(-EINVAL);
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return ERR_PTR(-errno);
+
+    /* foreign endianness is swapped in place, leave that to the copy */
+    if (((struct btf_header*)data)->magic != BTF_MAGIC) {
+        munmap(data, st.st_size);
+        return ERR_PTR(-EPROTO);
+    }
+
+    btf = calloc(1, sizeof(*btf));
+    if (!btf) {
+        munmap(data, st.st_size);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    btf->start_id = 1;
+    btf->fd = -1;
+    btf->raw_data = data;
+    btf->raw_size = st.st_size;
+    btf->mmap_size = st.st_size;
+    btf->hdr = data;
+
+    err = btf_parse_hdr(btf);
+    if (!err) {
+        btf->strs_data = btf->raw_data + btf->hdr->hdr_len + btf->hdr->str_off;
+        btf->types_data = btf->raw_data + btf->hdr->hdr_len + btf->hdr->type_off;
+
+        err = btf_parse_str_sec(btf);
+        err = err ? : btf_parse_type_sec(btf);
+    }
+
+    if (err) {
+        btf_free(btf);
+        return ERR_PTR(err);
+    }
+
+    return btf;
+}
+
 static btf_t* btf_parse(const char* path) {
     struct btf_t* btf;
     int err = 0;
@@ -811,7 +1018,11 @@ btf_t* btf_load_vmlinux() {
 		_pr_warn("kernel BTF is missing at '%s', was CONFIG_DEBUG_INFO_BTF enabled?\n",
 			sysfs_btf_path);
 	} else {
-		btf = vy_btf__parse(sysfs_btf_path);
+		btf = ut_err(btf_parse_mmap(sysfs_btf_path));
+		if (!btf) {
+			_pr_debug("could not map kernel BTF (%d), reading it\n", -errno);
+			btf = vy_btf__parse(sysfs_btf_path);
+		}
 		if (!btf) {
 			err = -errno;
 			_pr_warn("failed to read kernel BTF from '%s': %d\n", sysfs_btf_path, err);
@@ -823,6 +1034,19 @@ btf_t* btf_load_vmlinux() {
 }
 
 
+static btf_t* vmlinux_btf;
+
+/* one handle for the whole run, loaded when the first field is resolved */
+btf_t* btf_vmlinux(void) {
+    if (!vmlinux_btf) {
+        vmlinux_btf = btf_load_vmlinux();
+        if (!vmlinux_btf)
+            verror("could not load kernel BTF");
+    }
+
+    return vmlinux_btf;
+}
+
 struct btf_type* btf_type_by_id(const btf_t* btf, __u32 type_id) {
     if (type_id == 0)
         return ;
@@ -858,14 +1082,98 @@ const char* btf__name_by_offset(const btf_t* btf, __u32 offset) {
     return btf__str_by_offset(btf, offset);
 }
 
+static __u32 btf_hash(const char* name, __u32 key) {
+    __u32 h = 2166136261u ^ key;
+
+    while (*name)
+        h = (h ^ (__u8)*name++) * 16777619u;
+
+    return h;
+}
+
+static btf_hent_t* btf_htab_get(btf_htab_t* ht, __u32 key, const char* name) {
+    btf_hent_t* e;
+    __u32 i;
+
+    if (!ht->ent)
+        return NULL;
+
+    for (i = btf_hash(name, key) & ht->mask; (e = &ht->ent[i])->name; i = (i + 1) & ht->mask) {
+        if (e->key == key && !strcmp(e->name, name))
+            return e;
+    }
+
+    return NULL;
+}
+
+static void btf_htab_init(btf_htab_t* ht, __u32 hint) {
+    for (ht->mask = 1023; ht->mask < 2 * hint; ht->mask = 2 * ht->mask + 1);
+
+    ht->ent = calloc(ht->mask + 1, sizeof(*ht->ent));
+    if (!ht->ent)
+        verror("out of memory building an index");
+    ht->len = 0;
+}
+
+/* the first entry for a name stays, like a scan from the lowest id */
+static void btf_htab_add(btf_htab_t* ht, __u32 key, const char* name, __u32 val) {
+    btf_htab_t old = *ht;
+    btf_hent_t* e;
+    __u32 i;
+
+    if (2 * (ht->len + 1) > (ht->ent ? ht->mask + 1 : 0)) {
+        btf_htab_init(ht, old.ent ? old.mask + 1 : 0);
+        for (i = 0; old.ent && i <= old.mask; i++) {
+            if (old.ent[i].name)
+                btf_htab_add(ht, old.ent[i].key, old.ent[i].name, old.ent[i].val);
+        }
+        free(old.ent);
+    }
+
+    for (i = btf_hash(name, key) & ht->mask; (e = &ht->ent[i])->name; i = (i + 1) & ht->mask) {
+        if (e->key == key && !strcmp(e->name, name))
+            return;
+    }
+
+    e->name = name;
+    e->key = key;
+    e->val = val;
+    ht->len++;
+}
+
+/* every named type, indexed by name and kind on the first lookup */
+static void btf_index_names(btf_t* btf) {
+    const struct btf_type* type;
+    const char* name;
+    __u32 i, nr_types = btf__type_cnt(btf);
+
+    btf_htab_init(&btf->names, nr_types);
+    for (i = btf->start_id; i < nr_types; i++) {
+        type = btf_type_by_id(btf, i);
+        name = btf__name_by_offset(btf, type->name_off);
+        if (name && *name)
+            btf_htab_add(&btf->names, btf_kind(type), name, i);
+    }
+}
+
 static __s32 btf_find_by_name_kind(
     const struct btf* btf, int start_id, const char* type_name, __u32 kind) 
 {
+    btf_t* b = (btf_t*)btf;
+    btf_hent_t* e;
     __u32 i, nr_types = btf__type_cnt(btf);
     if (kind == BTF_KIND_UNKN || !strcmp(type_name, "void")) {
         return 0;
     }
 
+    if (!b->base_btf && start_id <= b->start_id) {
+        if (!b->names.ent)
+            btf_index_names(b);
+
+        e = btf_htab_get(&b->names, kind, type_name);
+        return e ? e->val : libbpf_err(-ENOENT);
+    }
+
     for (i = start_id; i < nr_types; i++) {
         const struct btf_type* type = btf__type_by_id(btf, i);
         const char* name;
@@ -887,39 +1195,224 @@ __s32 btf__find_by_name_kind(const struct btf *btf, const char *type_name, __u32
 	return btf_find_by_name_kind(btf, 1, type_name, kind);
 }
 
-int btf_get_field_off(const char *struct_name, const char *field_name) {
-    int offset = -1;
-    int struct_id;
-    struct btf_member *member;
-    const struct btf_type *type;
-    btf_t* btf;
+/* a struct's members are indexed the first time any of them is asked
+ * for, later lookups on the same struct are a hash probe */
+static struct btf_member* btf_member_find(btf_t* btf, __u32 struct_id, const char* field) {
+    const struct btf_type* type = btf_type_by_id(btf, struct_id);
+    struct btf_member* member = btf_members(type);
+    const char* name;
+    btf_hent_t* e;
+    __u32 i;
+
+    if (!btf->members_done) {
+        btf->members_done = calloc(btf__type_cnt(btf) / 8 + 1, 1);
+        if (!btf->members_done)
+            verror("out of memory indexing BTF");
+    }
+
+    if (!(btf->members_done[struct_id / 8] & (1 << (struct_id % 8)))) {
+        for (i = 0; i < btf_vlen(type); i++) {
+            name = btf__name_by_offset(btf, member[i].name_off);
+            if (name && *name)
+                btf_htab_add(&btf->members, struct_id, name, i);
+        }
+        btf->members_done[struct_id / 8] |= 1 << (struct_id % 8);
+    }
 
-    btf = btf_load_vmlinux();
+    e = btf_htab_get(&btf->members, struct_id, field);
+    return e ? &member[e->val] : NULL;
+}
 
-    struct_id = btf__find_by_name_kind(btf, struct_name, BTF_KIND_STRUCT);
-    if (struct_id < 0) {
-        verror("can't find structure %s", struct_name);
+/* bytes taken by a type, looking through typedefs and qualifiers */
+static int btf_type_bytes(btf_t* btf, __u32 id) {
+    const struct btf_type* t;
+    int depth, n;
+
+    for (depth = 0; depth < 32; depth++) {
+        t = btf_type_by_id(btf, id);
+        if (!t)
+            return -ENOENT;
+
+        switch (btf_kind(t)) {
+        case BTF_KIND_INT:
+        case BTF_KIND_ENUM:
+        case BTF_KIND_ENUM64:
+        case BTF_KIND_STRUCT:
+        case BTF_KIND_UNION:
+            return t->size;
+        case BTF_KIND_PTR:
+            return sizeof(void*);
+        case BTF_KIND_ARRAY:
+            n = btf_type_bytes(btf, btf_array(t)->type);
+            return n < 0 ? n : n * btf_array(t)->nelems;
+        case BTF_KIND_TYPEDEF:
+        case BTF_KIND_VOLATILE:
+        case BTF_KIND_CONST:
+        case BTF_KIND_RESTRICT:
+        case BTF_KIND_TYPE_TAG:
+            id = t->type;
+            break;
+        default:
+            return -EINVAL;
+        }
+    }
+
+    return -ELOOP;
+}
+
+/* structs are named by their type name, anonymous ones by "#id" */
+static void btf_type_key(btf_t* btf, __u32 id, char* key, size_t len) {
+    const char* name = btf__name_by_offset(btf, btf_type_by_id(btf, id)->name_off);
+
+    if (name && *name)
+        snprintf(key, len, "%s", name);
+    else
+        snprintf(key, len, "#%u", id);
+}
+
+static __s32 btf_struct_find(btf_t* btf, const char* key) {
+    __s32 id;
+
+    if (key[0] == '#')
+        return strtol(key + 1, NULL, 10);
+
+    id = btf__find_by_name_kind(btf, key, BTF_KIND_STRUCT);
+    if (id < 0)
+        id = btf__find_by_name_kind(btf, key, BTF_KIND_UNION);
+
+    return id;
+}
+
+static __u32 btf_skip_mods(btf_t* btf, __u32 id) {
+    const struct btf_type* t;
+
+    while ((t = btf_type_by_id(btf, id))) {
+        switch (btf_kind(t)) {
+        case BTF_KIND_TYPEDEF:
+        case BTF_KIND_VOLATILE:
+        case BTF_KIND_CONST:
+        case BTF_KIND_RESTRICT:
+        case BTF_KIND_TYPE_TAG:
+            id = t->type;
+            break;
+        default:
+            return id;
+        }
+    }
+
+    return id;
+}
+
+/* members of anonymous structs and unions are found as if they were
+ * the outer struct's own */
+static struct btf_member* btf_member_walk(btf_t* btf, __u32 id, const char* field,
+        __u32* bits, __u32* bitsize) {
+    const struct btf_type* type = btf_type_by_id(btf, id);
+    struct btf_member* member, *m;
+    const struct btf_type* t;
+    __u32 i, sub;
+
+    member = btf_member_find(btf, id, field);
+    if (member) {
+        *bits = BTF_INFO_KFLAG(type->info) ? BTF_MEMBER_BIT_OFFSET(member->offset) : member->offset;
+        *bitsize = BTF_INFO_KFLAG(type->info) ? BTF_MEMBER_BITFIELD_SIZE(member->offset) : 0;
+        return member;
     }
-    type = btf__type_by_id(btf, struct_id);
-    if (!type)
-        verror("can t get btf_type for %s", struct_name);
 
-    member = (struct btf_member *)(type + 1);
-    for (size_t i = 0; i < BTF_INFO_VLEN(type->info); ++i, ++member) {
-        const char *cur_name = btf__name_by_offset(btf, member->name_off);
-        if (!cur_name || !vstreq(cur_name, field_name))
+    m = btf_members(type);
+    for (i = 0; i < btf_vlen(type); i++, m++) {
+        if (m->name_off && *btf__name_by_offset(btf, m->name_off))
+            continue;
+
+        sub = btf_skip_mods(btf, m->type);
+        t = btf_type_by_id(btf, sub);
+        if (!t || (btf_kind(t) != BTF_KIND_STRUCT && btf_kind(t) != BTF_KIND_UNION))
             continue;
 
-        if (BTF_INFO_KFLAG(type->info))
-            offset = BTF_MEMBER_BIT_OFFSET(member->offset);
-        else
-            offset = member->offset;
+        member = btf_member_walk(btf, sub, field, bits, bitsize);
+        if (member) {
+            *bits += BTF_INFO_KFLAG(type->info) ? BTF_MEMBER_BIT_OFFSET(m->offset) : m->offset;
+            return member;
+        }
+    }
+
+    return NULL;
+}
+
+static void btf_field_describe(btf_t* btf, __u32 id, struct_field_t* f) {
+    const struct btf_type* t;
+    __u32 target;
 
+    id = btf_skip_mods(btf, id);
+    t = btf_type_by_id(btf, id);
+
+    f->size = btf_type_bytes(btf, id);
+    f->sign = 0;
+    f->type[0] = '\0';
+
+    switch (btf_kind(t)) {
+    case BTF_KIND_INT:
+        f->sign = !!(BTF_INT_ENCODING(*(__u32*)(t + 1)) & BTF_INT_SIGNED);
+        break;
+    case BTF_KIND_ENUM:
+    case BTF_KIND_ENUM64:
+        f->sign = BTF_INFO_KFLAG(t->info);
+        break;
+    case BTF_KIND_PTR:
+        target = btf_skip_mods(btf, t->type);
+        t = btf_type_by_id(btf, target);
+        if (t && (btf_kind(t) == BTF_KIND_STRUCT || btf_kind(t) == BTF_KIND_UNION)) {
+            f->type[0] = '*';
+            btf_type_key(btf, target, f->type + 1, sizeof(f->type) - 1);
+        }
+        break;
+    case BTF_KIND_STRUCT:
+    case BTF_KIND_UNION:
+        btf_type_key(btf, id, f->type, sizeof(f->type));
+        break;
+    case BTF_KIND_ARRAY:
+        strcpy(f->type, "[]");
+        break;
+    default:
         break;
     }
+}
+
+int btf_get_member(const char* struct_name, const char* field_name, struct_field_t* f) {
+    struct btf_member *member;
+    __s32 struct_id;
+    __u32 bits, bitsize;
+    btf_t* btf;
+
+    if (layout_cache_struct(struct_name, field_name, f))
+        return 0;
+
+    btf = btf_vmlinux();
+
+    struct_id = btf_struct_find(btf, struct_name);
+    if (struct_id < 0 || !btf__type_by_id(btf, struct_id)) {
+        verror("can't find structure %s", struct_name);
+    }
+
+    /* bitfields share their bytes with neighbours, so are not offered */
+    member = btf_member_walk(btf, struct_id, field_name, &bits, &bitsize);
+    if (!member || bits % 8 || bitsize)
+        return -ENOENT;
 
-    if (offset < 0 || offset % 8)
+    btf_field_describe(btf, member->type, f);
+    if (f->size < 0)
         return -ENOENT;
 
-    return offset / 8;
-}
\ No newline at end of file
+    f->offs = bits / 8;
+    layout_cache_struct_add(struct_name, field_name, f);
+    return 0;
+}
+
+int btf_get_field_off(const char *struct_name, const char *field_name) {
+    struct_field_t f;
+
+    if (btf_get_member(struct_name, field_name, &f))
+        return -ENOENT;
+
+    return f.offs;
+}
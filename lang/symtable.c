@@ -1,5 +1,6 @@
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "symtable.h"
 #include "ut.h"
@@ -16,7 +17,7 @@ static void sym_init(symtable_t *st) {
 symtable_t *symtable_new() {
     symtable_t *st;
 
-    st = vmalloc(sizeof(*st));
+    st = vcalloc(1, sizeof(*st));
     st->cap = 16;
     st->table = vcalloc(st->cap, sizeof(*st->table));
 
@@ -106,20 +107,157 @@ void var_dec(symtable_t* st, node_t* var, node_t* expr) {
 }
 
 
-smap_t* map_create(node_t* map) {
+int map_percpu = 0;
+
+static struct {
+    const char *name;
+    enum bpf_map_type type;
+} map_types[] = {
+    { "hash", BPF_MAP_TYPE_HASH },
+    { "percpu_hash", BPF_MAP_TYPE_PERCPU_HASH },
+    { "lru_hash", BPF_MAP_TYPE_LRU_HASH },
+    { "lru_percpu_hash", BPF_MAP_TYPE_LRU_PERCPU_HASH },
+    { "array", BPF_MAP_TYPE_ARRAY },
+    { "percpu_array", BPF_MAP_TYPE_PERCPU_ARRAY },
+    {}
+};
+
+bool map_is_percpu(enum bpf_map_type type) {
+    return type == BPF_MAP_TYPE_PERCPU_HASH
+        || type == BPF_MAP_TYPE_LRU_PERCPU_HASH
+        || type == BPF_MAP_TYPE_PERCPU_ARRAY;
+}
+
+bool map_is_array(enum bpf_map_type type) {
+    return type == BPF_MAP_TYPE_ARRAY || type == BPF_MAP_TYPE_PERCPU_ARRAY;
+}
+
+static enum bpf_map_type map_to_percpu(enum bpf_map_type type) {
+    switch (type) {
+    case BPF_MAP_TYPE_HASH:
+        return BPF_MAP_TYPE_PERCPU_HASH;
+    case BPF_MAP_TYPE_LRU_HASH:
+        return BPF_MAP_TYPE_LRU_PERCPU_HASH;
+    case BPF_MAP_TYPE_ARRAY:
+        return BPF_MAP_TYPE_PERCPU_ARRAY;
+    default:
+        return type;
+    }
+}
+
+/* name := type(entries, flag...); */
+void map_spec_dec(symtable_t* st, node_t* dec) {
+    node_t* var, *call, *arg;
+    map_spec_t* spec;
+    size_t i;
+
+    var = dec->dec.var;
+    call = dec->dec.expr;
+
+    if (var->type != NODE_VAR || !call || call->type != NODE_CALL)
+        verror("expected a map declaration, e.g. m := hash(4096);");
+
+    for (i = 0; i < st->nspecs; i++) {
+        if (!strcmp(st->specs[i].name, var->name))
+            verror("map '%s' is already declared.", var->name);
+    }
+
+    st->specs = realloc(st->specs, (st->nspecs + 1) * sizeof(*st->specs));
+    spec = &st->specs[st->nspecs++];
+    memset(spec, 0, sizeof(*spec));
+    spec->name = var->name;
+
+    for (i = 0; map_types[i].name; i++) {
+        if (!strcmp(map_types[i].name, call->name))
+            break;
+    }
+
+    if (!map_types[i].name)
+        verror("unknown map type: %s", call->name);
+
+    spec->type = map_types[i].type;
+
+    arg = call->call.args;
+    if (!arg || arg->type != NODE_INT || !arg->integer)
+        verror("map '%s' needs a number of entries", var->name);
+
+    spec->entries = arg->integer;
+
+    for (arg = arg->next; arg; arg = arg->next) {
+        if (arg->type != NODE_VAR || strcmp(arg->name, "no_prealloc"))
+            verror("unknown flag for map '%s'", var->name);
+
+        spec->flags |= BPF_F_NO_PREALLOC;
+    }
+
+    /* lru and array maps are always preallocated */
+    if ((spec->flags & BPF_F_NO_PREALLOC)
+        && spec->type != BPF_MAP_TYPE_HASH
+        && spec->type != BPF_MAP_TYPE_PERCPU_HASH)
+        verror("map '%s': no_prealloc needs a hash or percpu_hash map", var->name);
+}
+
+static map_spec_t* map_spec_get(symtable_t* st, const char* name) {
+    size_t i;
+
+    for (i = 0; i < st->nspecs; i++) {
+        if (!strcmp(st->specs[i].name, name))
+            return &st->specs[i];
+    }
+
+    return NULL;
+}
+
+/* a single key that can only be a small integer, like cpu(), indexes
+ * an array instead of being hashed. returns the number of slots. */
+static size_t map_key_range(node_t* map) {
+    node_t* key = map->map.args;
+
+    if (!key || key->next || map->annot.ksize != sizeof(int64_t))
+        return 0;
+
+    switch (key->type) {
+    case NODE_CALL:
+        if (!strcmp(key->name, "cpu") && !key->call.args)
+            return cpus_possible();
+        break;
+    case NODE_INT:
+        if (key->integer < MAP_ARRAY_MAX_KEY)
+            return key->integer + 1;
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+smap_t* map_create(node_t* map, map_spec_t* spec) {
     ssize_t ksize, vsize;
     smap_t* smap;
 
     ksize = map->annot.ksize;
     vsize = map->annot.size;
 
-    map->annot.mapid = bpf_map_create(
-        BPF_MAP_TYPE_HASH, ksize, vsize, 1024);
+    /* array keys are u32, the low half of our 8 byte integers */
+    if (map_is_array(spec->type)) {
+        if (ksize != sizeof(int64_t))
+            verror("array map '%s' needs a single integer key", map->name);
+        ksize = sizeof(uint32_t);
+    }
+
+    map->annot.mapid = bpf_map_create(spec->type, ksize, vsize,
+            spec->entries, spec->flags);
+    if (map->annot.mapid < 0)
+        verror("could not create map '%s': %s", map->name,
+                strerror(-map->annot.mapid));
 
     smap = calloc(1, sizeof(*smap));
 
+    smap->type = spec->type;
     smap->ksize = ksize;
     smap->vsize = vsize;
+    smap->nelem = spec->entries;
     smap->ktype = map->map.args->annot.type;
     smap->id = map->annot.mapid;
     smap->map = map;
@@ -127,10 +265,15 @@ smap_t* map_create(node_t* map) {
     return smap;
 }
 
-void map_dec(symtable_t* st, node_t* map, node_t* expr) {
+/* a declaration wins, otherwise a provable key range picks an array.
+ * percpu asks for the per-cpu flavour of whatever type that is. */
+static smap_t* map_sym_add(symtable_t* st, node_t* map, bool percpu) {
+    map_spec_t spec = { .type = BPF_MAP_TYPE_HASH, .entries = MAP_DEFAULT_ENTRIES };
+    map_spec_t* decl;
     sym_t* sym;
     char* name;
     smap_t* smap;
+    size_t range;
 
     name = map->name;
     sym = symtable_get(st, name);
@@ -139,12 +282,49 @@ void map_dec(symtable_t* st, node_t* map, node_t* expr) {
         verror("map '%s' is already defined.", name);
     }
 
-    smap = map_create(map);
+    decl = map_spec_get(st, name);
+    if (decl) {
+        spec = *decl;
+    } else if ((range = map_key_range(map))) {
+        spec.type = BPF_MAP_TYPE_ARRAY;
+        spec.entries = range;
+    }
+
+    if (percpu)
+        spec.type = map_to_percpu(spec.type);
+
+    smap = map_create(map, &spec);
     
     sym = symtable_add(st, name);
     sym->type = SYM_MAP;
     sym->vannot = map->annot;
     sym->map = smap;
+
+    return smap;
+}
+
+void map_dec(symtable_t* st, node_t* map, node_t* expr) {
+    smap_t* smap;
+
+    smap = map_sym_add(st, map, false);
+
+    /* other probes read back what this cpu stored */
+    if (map_is_percpu(smap->type))
+        verror("map '%s': per-cpu maps can only hold aggregations", map->name);
+}
+
+/* counters are atomic in a shared map unless -c asks for per-cpu
+ * ones, everything else only ever updates its own cpu's slot. */
+void map_agg_dec(symtable_t* st, node_t* map, node_t* method, agg_t agg) {
+    bool percpu = true;
+    smap_t* smap;
+
+    if ((agg == AGG_COUNT || agg == AGG_HIST) && !map_percpu)
+        percpu = false;
+
+    smap = map_sym_add(st, map, percpu);
+    smap->agg = agg;
+    smap->method = method;
 }
 
 int sym_ref(symtable_t* st, node_t* var) {
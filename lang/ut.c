@@ -6,9 +6,15 @@
 #include <stdio.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <unistd.h>
 
 #include "ut.h"
 
+#define OBUF_SIZE (256 << 10)
+
+static char obuf[OBUF_SIZE];
+static size_t olen;
+
 noreturn void verror(char *fmt, ...) {
 	va_list ap;
 	va_start(ap, fmt);
@@ -30,7 +36,7 @@ long get_error(const void* ptr) {
 }
 
 vec_t *vec_new() {
-	vec_t *vec = vmalloc(sizeof(vec));
+	vec_t *vec = vmalloc(sizeof(*vec));
 	vec->data = vmalloc(sizeof(void *) * 16);
 	vec->cap = 16;
 	vec->len = 0;
@@ -155,6 +161,64 @@ char *str_escape(char *str) {
 	return str;
 }
 
+int cpulist_parse(const char *list, bool *mask, int n) {
+	const char *s = list;
+	char *end;
+	long lo, hi;
+
+	memset(mask, 0, n * sizeof(*mask));
+
+	while (*s && *s != '\n') {
+		lo = strtol(s, &end, 10);
+		if (end == s)
+			return -EINVAL;
+
+		hi = lo;
+		if (*end == '-') {
+			s = end + 1;
+			hi = strtol(s, &end, 10);
+			if (end == s)
+				return -EINVAL;
+		}
+
+		for (; lo <= hi; lo++) {
+			if (lo >= 0 && lo < n)
+				mask[lo] = true;
+		}
+
+		s = end;
+		if (*s == ',')
+			s++;
+	}
+
+	return 0;
+}
+
+/* per-cpu map values are sized by the possible cpus, which can be more
+ * than are configured or online. */
+int cpus_possible(void) {
+	static int n;
+	char buf[64], *p;
+	FILE *fp;
+
+	if (n)
+		return n;
+
+	fp = fopen("/sys/devices/system/cpu/possible", "r");
+	if (fp) {
+		if (fgets(buf, sizeof(buf), fp)) {
+			p = strrchr(buf, '-');
+			n = strtol(p ? p + 1 : buf, NULL, 10) + 1;
+		}
+		fclose(fp);
+	}
+
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_CONF);
+
+	return n;
+}
+
 char *read_file(char *filename) {
 	char *input = (char *)calloc(BUFSIZ, sizeof(char));
 	assert(input != NULL);
@@ -182,6 +246,70 @@ char *read_file(char *filename) {
 }
 
 
+void obuf_flush(void) {
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < olen) {
+		n = write(STDOUT_FILENO, obuf + done, olen - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		done += n;
+	}
+
+	olen = 0;
+}
+
+char *obuf_reserve(size_t len) {
+	if (olen + len > OBUF_SIZE)
+		obuf_flush();
+
+	return obuf + olen;
+}
+
+void obuf_commit(size_t len) {
+	olen += len;
+}
+
+void obuf_write(const void *data, size_t len) {
+	if (len > OBUF_SIZE) {
+		obuf_flush();
+		write(STDOUT_FILENO, data, len);
+		return;
+	}
+
+	memcpy(obuf_reserve(len), data, len);
+	olen += len;
+}
+
+__printf(1, 2)
+void obuf_printf(const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(obuf + olen, OBUF_SIZE - olen, fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return;
+
+	if (olen + n >= OBUF_SIZE) {
+		obuf_flush();
+		va_start(ap, fmt);
+		n = vsnprintf(obuf, OBUF_SIZE, fmt, ap);
+		va_end(ap);
+
+		if (n >= OBUF_SIZE)
+			n = OBUF_SIZE - 1;
+	}
+
+	olen += n;
+}
+
 void print_bar_ascii(FILE *fp, int64_t count, int64_t max) {
 	int w = (((float)count / (float)max) * 32.0) + 0.5;
 	int i;
@@ -235,6 +363,24 @@ void output_hist(FILE* fp, int log2, int64_t count, int64_t max) {
     fputc('\n', fp);
 }
 
+/* bucket 0 and nbuckets + 1 hold the values below min and from max on */
+void output_lhist(FILE* fp, int64_t bucket, int64_t min, int64_t max,
+		  int64_t step, int64_t count, int64_t cmax) {
+	int64_t lo = min + (bucket - 1) * step;
+	int64_t hi = lo + step < max ? lo + step : max;
+
+	if (bucket == 0)
+		fprintf(fp, "\t(%6s, %6" PRId64 ")", "...", min);
+	else if (lo >= max)
+		fprintf(fp, "\t[%6" PRId64 ", %6s)", max, "...");
+	else
+		fprintf(fp, "\t[%6" PRId64 ", %6" PRId64 ")", lo, hi);
+
+	fprintf(fp, "\t%8" PRId64 " ", count);
+	print_bar_ascii(fp, count, cmax);
+	fputc('\n', fp);
+}
+
 static int base_pr(enum print_level level, const char* format, va_list args) {
 	const char* env_var = "VY_LOG_LEVEL";
 	static enum print_level min_level = PRINT_INFO;
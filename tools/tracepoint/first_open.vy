@@ -0,0 +1,13 @@
+#syscalls;
+
+seen := hash(4096);
+
+BEGIN {
+    out("%-18s %-16s %-6s\n", "PID", "COMM", "FILE");
+}
+
+probe sys_enter_openat /seen[pid()] == 0/ {
+    seen[pid()] := 1;
+    file := args->filename;
+    out("%-18d %-16s %-6s\n", pid(), comm(), file);
+}